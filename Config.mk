@@ -54,6 +54,24 @@
 #
         NDISKS=1
 
+#
+# Set the frequency of the periodic timer interrupt, in Hz. With UPREEMPT=1
+# this is how often a running user thread is checked against its quantum.
+#
+        TIMER_HZ=100
+
+#
+# Set the most processors to schedule on. Each gets its own run queues. Only
+# 1 is supported for now: nothing starts the other processors yet.
+#
+        NCPU=1
+
+#
+# Set the most processes that can exist at once, and so the PID range. PIDs
+# are tracked in a bitmap of PROC_MAX_COUNT bits.
+#
+        PROC_MAX_COUNT=65536
+
 # Switches for non-required components. If you wish to try implementing
 # some extra features in Weenix, there are some pre-designed features
 # you can add. Turn on one of these flags and re-compile Weenix. Please
@@ -72,12 +90,14 @@
         UPREEMPT=0 # userland preemption
              MTP=0 # multiple kernel threads per process
          SHADOWD=0 # shadow page cleanup
+        LOCKPROF=0 # kmutex contention profiling ("lockstat" in kshell)
+    KSTACK_GUARD=0 # check a guard page below each kernel stack
 
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP SHADOWD GETCWD UPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP SHADOWD GETCWD UPREEMPT LOCKPROF KSTACK_GUARD"
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR"
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR TIMER_HZ NCPU PROC_MAX_COUNT"
 
 # Parameters for the hard disk we build (must be compatible!)
 # If the FS is too big for the disk, BAD things happen!
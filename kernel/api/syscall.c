@@ -4,9 +4,12 @@
 #include "types.h"
 
 #include "main/interrupt.h"
+#include "main/tsc.h"
+#include "main/timer.h"
 
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/mlfq.h"
 
 #include "util/init.h"
 #include "util/string.h"
@@ -18,20 +21,28 @@
 #include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/kmalloc.h"
+#include "mm/tlb.h"
 
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "fs/lseek.h"
 
 #include "test/kshell/kshell.h"
 
 #include "vm/brk.h"
 #include "vm/mmap.h"
 #include "vm/vmmap.h"
+#include "vm/kinfo.h"
+#include "vm/futex.h"
 
 #include "api/syscall.h"
 #include "api/utsname.h"
 #include "api/access.h"
 #include "api/exec.h"
+#include "api/sysring.h"
+#include "api/systat.h"
+#include "api/nanosleep.h"
+#include "api/thread.h"
 
 static void syscall_handler(regs_t *regs);
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs);
@@ -42,6 +53,124 @@ static __attribute__((unused)) void syscall_init(void)
 }
 init_func(syscall_init);
 
+/*
+ * Moves up to nbytes from fd into the user buffer ubuf, one page at a
+ * time through a kernel bounce page. If pos is NULL the transfer goes
+ * through do_read() and advances f_pos; otherwise it goes through
+ * do_pread() starting at *pos, and *pos is advanced instead. Stops early
+ * on a short read. Returns the number of bytes moved, which is short if
+ * an error stopped it after some progress, or -errno if none was made.
+ */
+static int
+read_to_user(int fd, void *ubuf, size_t nbytes, off_t *pos)
+{
+    size_t total = 0;
+    int bytes_read, ret;
+    void *tmp_buf;
+
+    if (nbytes == 0) {
+        return 0;
+    }
+    if ((tmp_buf = page_alloc()) == NULL) {
+        return -ENOMEM;
+    }
+
+    while (total < nbytes) {
+        size_t chunk = nbytes - total;
+        if (chunk > PAGE_SIZE) {
+            chunk = PAGE_SIZE;
+        }
+
+        if (pos == NULL) {
+            bytes_read = do_read(fd, tmp_buf, chunk);
+        } else {
+            bytes_read = do_pread(fd, tmp_buf, chunk, *pos);
+        }
+        if (bytes_read < 0) {
+            ret = bytes_read;
+            goto out;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        if ((ret = copy_to_user((void *)((uint32_t)ubuf + total), tmp_buf, bytes_read)) < 0) {
+            /* those bytes never reached the user; give them back to the
+             * file if it can seek, so that a later read sees them */
+            if (pos == NULL) {
+                do_lseek(fd, -bytes_read, SEEK_CUR);
+            }
+            goto out;
+        }
+
+        total += bytes_read;
+        if (pos != NULL) {
+            *pos += bytes_read;
+        }
+        if ((size_t)bytes_read < chunk) {
+            break;
+        }
+    }
+    ret = 0;
+
+out:
+    page_free(tmp_buf);
+    /* bytes already moved are reported, not the error that stopped us */
+    return (total > 0) ? (int)total : ret;
+}
+
+/*
+ * The write-side counterpart of read_to_user(): moves nbytes from the
+ * user buffer ubuf to fd, through do_write() when pos is NULL and
+ * through do_pwrite() at *pos otherwise.
+ */
+static int
+write_from_user(int fd, const void *ubuf, size_t nbytes, off_t *pos)
+{
+    size_t total = 0;
+    int bytes_written, ret;
+    void *tmp_buf;
+
+    if (nbytes == 0) {
+        return 0;
+    }
+    if ((tmp_buf = page_alloc()) == NULL) {
+        return -ENOMEM;
+    }
+
+    while (total < nbytes) {
+        size_t chunk = nbytes - total;
+        if (chunk > PAGE_SIZE) {
+            chunk = PAGE_SIZE;
+        }
+
+        if ((ret = copy_from_user(tmp_buf, (void *)((uint32_t)ubuf + total), chunk)) < 0) {
+            goto out;
+        }
+        if (pos == NULL) {
+            bytes_written = do_write(fd, tmp_buf, chunk);
+        } else {
+            bytes_written = do_pwrite(fd, tmp_buf, chunk, *pos);
+        }
+        if (bytes_written < 0) {
+            ret = bytes_written;
+            goto out;
+        }
+
+        total += bytes_written;
+        if (pos != NULL) {
+            *pos += bytes_written;
+        }
+        if ((size_t)bytes_written < chunk) {
+            break;
+        }
+    }
+    ret = 0;
+
+out:
+    page_free(tmp_buf);
+    return (total > 0) ? (int)total : ret;
+}
+
 /*
  * this is one of the few sys_* functions you have to write. be sure to
  * check out the sys_* functions we have provided before trying to write
@@ -58,49 +187,18 @@ sys_read(read_args_t *arg)
 {
     /*NOT_YET_IMPLEMENTED("VM: sys_read");*/
     read_args_t kern_args;
-    int bytes_read, ret;
+    int ret;
     if((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0){
         curthr->kt_errno = -ret;
         return -1;
     }
     
-    size_t total_bytes_read = 0;
-    
-    size_t needToRead = kern_args.nbytes;
-    
-    
-    void *tmp_buf;
-    while(needToRead > 0){
-        tmp_buf = page_alloc();
-        /* NOte: the 2nd argument is the kernel's temporary buffer we've allocated in the line above */
-        if(needToRead >= PAGE_SIZE){
-            if((bytes_read = do_read(kern_args.fd, tmp_buf, PAGE_SIZE)) < 0){
-                curthr->kt_errno = -bytes_read;
-                return -1;
-            }
-            if((ret = copy_to_user(kern_args.buf, tmp_buf, PAGE_SIZE)) < 0){
-                curthr->kt_errno = -ret;
-                return -1;
-            }
-            needToRead -= PAGE_SIZE;
-            
-        } else {
-            if((bytes_read = do_read(kern_args.fd, tmp_buf, needToRead)) < 0){
-                curthr->kt_errno = -bytes_read;
-                return -1;
-            }
-            if((ret = copy_to_user(kern_args.buf, tmp_buf, needToRead)) < 0){
-                curthr->kt_errno = -ret;
-                return -1;
-            }
-            needToRead -= needToRead;
-        }
-        
-        page_free(tmp_buf);
-        total_bytes_read += bytes_read;
-        
+    /* page by page through one bounce page, stopping on a short read */
+    if ((ret = read_to_user(kern_args.fd, kern_args.buf, kern_args.nbytes, NULL)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
     }
-    return total_bytes_read;
+    return ret;
 }
 
 /*
@@ -111,46 +209,183 @@ sys_write(write_args_t *arg)
 {
     /*NOT_YET_IMPLEMENTED("VM: sys_write");*/
     write_args_t kern_args;
-    int bytes_written, ret;
+    int ret;
     if((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0){
         curthr->kt_errno = -ret;
         return -1;
     }
-    void *tmp_buf;
     
-    size_t total_bytes_write = 0;
-    size_t needToWrite = kern_args.nbytes;
-    
-    while (needToWrite > 0) {
-        tmp_buf = page_alloc();
-        
-        if(needToWrite >= PAGE_SIZE ){
-            
-            if((ret = copy_from_user(tmp_buf, kern_args.buf,PAGE_SIZE)) < 0){
-                curthr->kt_errno = -ret;
-                return -1;
-            }
-            if((bytes_written = do_write(kern_args.fd, tmp_buf, PAGE_SIZE)) < 0){
-                curthr->kt_errno = -bytes_written;
-                return -1;
-            }
-            needToWrite -= PAGE_SIZE;
-            
-        }else{
-            if((ret = copy_from_user(tmp_buf, kern_args.buf,needToWrite)) < 0){
-                curthr->kt_errno = -ret;
-                return -1;
+    if ((ret = write_from_user(kern_args.fd, kern_args.buf, kern_args.nbytes, NULL)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+/* the most one readv/writev may ask for: the count must fit its return */
+#define IOV_BYTES_MAX   0x7fffffffU
+
+/*
+ * Copies in the iovec array described by the user's readv/writev
+ * arguments, failing with EINVAL if the lengths add up to more than
+ * IOV_BYTES_MAX. The returned array must be kfree()'d by the caller.
+ */
+static struct iovec *
+iovec_copy_in(const struct iovec *uiov, int iovcnt, int *err)
+{
+    struct iovec *kiov;
+    size_t sum = 0;
+    int i, ret;
+
+    if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+        *err = -EINVAL;
+        return NULL;
+    }
+    if ((kiov = (struct iovec *)kmalloc(iovcnt * sizeof(struct iovec))) == NULL) {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    if ((ret = copy_from_user(kiov, uiov, iovcnt * sizeof(struct iovec))) < 0) {
+        kfree(kiov);
+        *err = ret;
+        return NULL;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (kiov[i].iov_len > IOV_BYTES_MAX - sum) {
+            kfree(kiov);
+            *err = -EINVAL;
+            return NULL;
+        }
+        sum += kiov[i].iov_len;
+    }
+    return kiov;
+}
+
+/*
+ * Scatter read: fills each buffer of the iovec in turn from the file's
+ * current position, stopping at the first short read, all in one trap.
+ */
+static int
+sys_readv(readv_args_t *arg)
+{
+    readv_args_t kern_args;
+    struct iovec *kiov;
+    size_t total = 0;
+    int i, ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    if ((kiov = iovec_copy_in(kern_args.iov, kern_args.iovcnt, &ret)) == NULL) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+
+    for (i = 0; i < kern_args.iovcnt; i++) {
+        if ((ret = read_to_user(kern_args.fd, kiov[i].iov_base, kiov[i].iov_len, NULL)) < 0) {
+            if (total > 0) {
+                break;
             }
-            if((bytes_written = do_write(kern_args.fd, tmp_buf, needToWrite)) < 0){
-                curthr->kt_errno = -bytes_written;
-                return -1;
+            kfree(kiov);
+            curthr->kt_errno = -ret;
+            return -1;
+        }
+        total += ret;
+        if ((size_t)ret < kiov[i].iov_len) {
+            break;
+        }
+    }
+
+    kfree(kiov);
+    return total;
+}
+
+/*
+ * Gather write: the write-side counterpart of sys_readv.
+ */
+static int
+sys_writev(writev_args_t *arg)
+{
+    writev_args_t kern_args;
+    struct iovec *kiov;
+    size_t total = 0;
+    int i, ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    if ((kiov = iovec_copy_in(kern_args.iov, kern_args.iovcnt, &ret)) == NULL) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+
+    for (i = 0; i < kern_args.iovcnt; i++) {
+        if ((ret = write_from_user(kern_args.fd, kiov[i].iov_base, kiov[i].iov_len, NULL)) < 0) {
+            if (total > 0) {
+                break;
             }
-            needToWrite -= needToWrite;
+            kfree(kiov);
+            curthr->kt_errno = -ret;
+            return -1;
+        }
+        total += ret;
+        if ((size_t)ret < kiov[i].iov_len) {
+            break;
         }
-        total_bytes_write += bytes_written;
-        page_free(tmp_buf);
     }
-    return total_bytes_write;
+
+    kfree(kiov);
+    return total;
+}
+
+/*
+ * Positional read: like sys_read, but at an explicit offset and without
+ * moving f_pos.
+ */
+static int
+sys_pread(pread_args_t *arg)
+{
+    pread_args_t kern_args;
+    off_t pos;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+
+    pos = kern_args.offset;
+    if ((ret = read_to_user(kern_args.fd, kern_args.buf, kern_args.nbytes, &pos)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Positional write: like sys_write, but at an explicit offset and
+ * without moving f_pos.
+ */
+static int
+sys_pwrite(pwrite_args_t *arg)
+{
+    pwrite_args_t kern_args;
+    off_t pos;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+
+    pos = kern_args.offset;
+    if ((ret = write_from_user(kern_args.fd, kern_args.buf, kern_args.nbytes, &pos)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return ret;
 }
 
 /*
@@ -168,6 +403,7 @@ sys_getdents(getdents_args_t *arg)
     /*NOT_YET_IMPLEMENTED("VM: sys_getdents");*/
     getdents_args_t kern_args;
     int bytes_read, ret;
+    void *tmp_buf;
     if((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0){
         curthr->kt_errno = -ret;
         return -1;
@@ -175,26 +411,48 @@ sys_getdents(getdents_args_t *arg)
     
     size_t total_bytes_read = 0;
     
-    /* dirent_t *dirp = NULL; */
-    dirent_t dirp;
-
-    /* Note: the read operation is performed by do_getdent() */
-    while(total_bytes_read < kern_args.count){
-        if((bytes_read = do_getdent(kern_args.fd, &dirp)) < 0){
-            curthr->kt_errno = -bytes_read;
-            return -1;
-        } else {
-            if(bytes_read == 0)
-            {
+    if((tmp_buf = page_alloc()) == NULL){
+        curthr->kt_errno = ENOMEM;
+        return -1;
+    }
+    
+    /* Note: the read operation is performed by do_getdents(), a page
+     * worth of entries at a time */
+    while(kern_args.count - total_bytes_read >= sizeof(dirent_t)){
+        size_t chunk = kern_args.count - total_bytes_read;
+        if(chunk > PAGE_SIZE){
+            chunk = PAGE_SIZE;
+        }
+        
+        if((bytes_read = do_getdents(kern_args.fd, (dirent_t *)tmp_buf, chunk)) < 0){
+            if(total_bytes_read > 0){
                 break;
             }
+            page_free(tmp_buf);
+            curthr->kt_errno = -bytes_read;
+            return -1;
+        }
+        if(bytes_read == 0){
+            break;
         }
         
-        if((ret = copy_to_user((void *)((uint32_t)kern_args.dirp + total_bytes_read), &dirp, sizeof(dirent_t))) < 0){
+        if((ret = copy_to_user((void *)((uint32_t)kern_args.dirp + total_bytes_read), tmp_buf, bytes_read)) < 0){
+            page_free(tmp_buf);
             curthr->kt_errno = -ret;
             return -1;
         }
-        total_bytes_read += sizeof(dirent_t);
+        total_bytes_read += bytes_read;
+        
+        /* a short batch means we hit the end of the directory */
+        if((size_t)bytes_read + sizeof(dirent_t) <= chunk){
+            break;
+        }
+    }
+    page_free(tmp_buf);
+    
+    if(total_bytes_read == 0 && kern_args.count < sizeof(dirent_t)){
+        curthr->kt_errno = EINVAL;
+        return -1;
     }
     return total_bytes_read;
 }
@@ -496,6 +754,37 @@ static int sys_lseek(lseek_args_t *args)
     } else return err;
 }
 
+static int sys_sendfile(sendfile_args_t *args)
+{
+    sendfile_args_t         kargs;
+    off_t                   off;
+    int                     err;
+    
+    if ((err = copy_from_user(&kargs, args, sizeof(sendfile_args_t))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+    
+    if (NULL == kargs.offset) {
+        err = do_sendfile(kargs.out_fd, kargs.in_fd, NULL, kargs.count);
+    } else {
+        if ((err = copy_from_user(&off, kargs.offset, sizeof(off_t))) < 0) {
+            curthr->kt_errno = -err;
+            return -1;
+        }
+        err = do_sendfile(kargs.out_fd, kargs.in_fd, &off, kargs.count);
+        if (err >= 0 && 0 > copy_to_user(kargs.offset, &off, sizeof(off_t))) {
+            curthr->kt_errno = EFAULT;
+            return -1;
+        }
+    }
+    
+    if (err < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    } else return err;
+}
+
 static int sys_open(open_args_t *arg)
 {
     open_args_t             kern_args;
@@ -701,6 +990,18 @@ static int sys_execve(execve_args_t *args, regs_t *regs)
     char **kern_envp = NULL;
     int err;
     
+#ifdef __MTP__
+    /* the other threads would go on running in the new image's address
+     * space, so they must all have exited first */
+    kthread_t *thr;
+    list_iterate_begin(&curproc->p_threads, thr, kthread_t, kt_plink) {
+        if (thr != curthr && KT_EXITED != thr->kt_state) {
+            curthr->kt_errno = EBUSY;
+            return -1;
+        }
+    } list_iterate_end();
+#endif
+    
     if ((err = copy_from_user(&kern_args, args, sizeof(kern_args))) < 0) {
         curthr->kt_errno = -err;
         goto cleanup;
@@ -724,6 +1025,11 @@ static int sys_execve(execve_args_t *args, regs_t *regs)
     
     err = do_execve(kern_filename, kern_argv, kern_envp, regs);
     
+    /* the new image got a fresh address space; too late to fail now */
+    if (0 == err && kinfo_map(curproc) < 0) {
+        dbg(DBG_PRINT, "kinfo_map failed for pid %d\n", curproc->p_pid);
+    }
+    
     curthr->kt_errno = -err;
     
 cleanup:
@@ -777,6 +1083,272 @@ static int sys_kshell(int ttyid)
     return 0;
 }
 
+/*
+ * Sleeps for at least the requested time, rounded up to whole timer
+ * ticks. If the thread is cancelled first, fails with EINTR and, if
+ * rem is not NULL, stores the time that was left.
+ */
+static int sys_nanosleep(nanosleep_args_t *arg)
+{
+    nanosleep_args_t kern_args;
+    struct timespec req, rem;
+    uint32_t ticks, remain = 0;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+        (ret = copy_from_user(&req, kern_args.req, sizeof(req))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+        curthr->kt_errno = EINVAL;
+        return -1;
+    }
+
+    /* one extra tick because the current one is already under way */
+    if ((uint32_t)req.tv_sec >= 0x7fffffffu / TIMER_HZ - 1) {
+        ticks = 0x7fffffffu;
+    } else {
+        ticks = (uint32_t)req.tv_sec * TIMER_HZ
+                + ((uint32_t)req.tv_nsec + TIMER_NS_PER_TICK - 1) / TIMER_NS_PER_TICK
+                + 1;
+    }
+
+    if ((ret = timer_sleep(ticks, &remain)) < 0) {
+        if (NULL != kern_args.rem) {
+            rem.tv_sec = remain / TIMER_HZ;
+            rem.tv_nsec = (remain % TIMER_HZ) * TIMER_NS_PER_TICK;
+            copy_to_user(kern_args.rem, &rem, sizeof(rem));
+        }
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef __MTP__
+/*
+ * Starts a thread in the calling process; see api/thread.h.
+ */
+static int sys_thr_create(thr_create_args_t *arg, regs_t *regs)
+{
+    thr_create_args_t kern_args;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0 ||
+        (ret = do_thr_create(regs, kern_args.entry, kern_args.arg, kern_args.stack)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static int sys_thr_join(thr_join_args_t *arg)
+{
+    thr_join_args_t kern_args;
+    kthread_t *thr;
+    void *retval;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        goto err;
+    }
+    if (NULL == (thr = kthread_lookup(curproc, kern_args.tid))) {
+        ret = -ESRCH;
+        goto err;
+    }
+    if ((ret = kthread_join(thr, &retval)) < 0) {
+        goto err;
+    }
+    /* the thread is gone either way, so a bad retval pointer only
+     * loses the value */
+    if (NULL != kern_args.retval &&
+        (ret = copy_to_user(kern_args.retval, &retval, sizeof(retval))) < 0) {
+        goto err;
+    }
+    return 0;
+err:
+    curthr->kt_errno = -ret;
+    return -1;
+}
+
+static int sys_thr_detach(int tid)
+{
+    kthread_t *thr;
+    int ret;
+
+    if (NULL == (thr = kthread_lookup(curproc, tid))) {
+        curthr->kt_errno = ESRCH;
+        return -1;
+    }
+    if ((ret = kthread_detach(thr)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * FUTEX_WAIT / FUTEX_WAKE on a word of user memory; see vm/futex.h.
+ */
+static int sys_futex(futex_args_t *arg)
+{
+    futex_args_t kern_args;
+    int ret;
+
+    if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    if ((ret = do_futex(kern_args.uaddr, kern_args.op, kern_args.val)) < 0) {
+        curthr->kt_errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+/*
+ * Maps a fresh submission/completion ring into the caller's address
+ * space and returns its user address. See api/sysring.h for the layout.
+ * The mapping is private, so a forked child gets its own copy.
+ */
+static void *sys_ring_setup(uint32_t entries)
+{
+    sysring_hdr_t hdr;
+    vmarea_t *vma;
+    uint32_t npages;
+    void *addr;
+    int err;
+    
+    if (0 == entries || entries > SYSRING_MAX_ENTRIES || (entries & (entries - 1))) {
+        curthr->kt_errno = EINVAL;
+        return MAP_FAILED;
+    }
+    
+    npages = ADDR_TO_PN(PAGE_ALIGN_UP(SYSRING_SIZE(entries)));
+    err = vmmap_map(curproc->p_vmmap, NULL, 0, npages, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, 0, VMMAP_DIR_HILO, &vma);
+    if (err < 0) {
+        curthr->kt_errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    addr = PN_TO_ADDR(vma->vma_start);
+    tlb_flush_range((uintptr_t)addr, npages);
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.sr_entries = entries;
+    hdr.sr_sq_off = sizeof(sysring_hdr_t);
+    hdr.sr_cq_off = sizeof(sysring_hdr_t) + entries * sizeof(sysring_sqe_t);
+    if ((err = copy_to_user(addr, &hdr, sizeof(hdr))) < 0) {
+        do_munmap(addr, npages * PAGE_SIZE);
+        curthr->kt_errno = -err;
+        return MAP_FAILED;
+    }
+    
+    return addr;
+}
+
+/*
+ * Returns nonzero if sysnum may be run from a ring. Anything that needs
+ * the trap frame, never returns, or would recurse into the ring is
+ * refused and completes with EINVAL.
+ */
+static int sysring_allowed(uint32_t sysnum)
+{
+    switch (sysnum) {
+        case SYS_exit:
+        case SYS_thr_exit:
+        case SYS_thr_create:
+        case SYS_fork:
+        case SYS_execve:
+        case SYS_halt:
+        case SYS_kshell:
+        case SYS_ring_setup:
+        case SYS_ring_enter:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * Runs up to to_submit queued entries of the ring in order, posting one
+ * completion per entry, and returns how many were consumed. Stops early
+ * if the submission queue runs dry, the completion queue fills up, or
+ * the thread is cancelled (the trap handler then exits it as usual).
+ * The ring is ordinary user memory, so everything read from it is
+ * treated as untrusted.
+ */
+static int sys_ring_enter(ring_enter_args_t *args, regs_t *regs)
+{
+    ring_enter_args_t kargs;
+    sysring_hdr_t hdr;
+    sysring_sqe_t sqe;
+    sysring_cqe_t cqe;
+    uint32_t done = 0;
+    int err = 0;
+    
+    if ((err = copy_from_user(&kargs, args, sizeof(kargs))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+    if ((err = copy_from_user(&hdr, kargs.ring, sizeof(hdr))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+    if (0 == hdr.sr_entries || hdr.sr_entries > SYSRING_MAX_ENTRIES
+        || (hdr.sr_entries & (hdr.sr_entries - 1))
+        || hdr.sr_sq_off != sizeof(sysring_hdr_t)
+        || hdr.sr_cq_off != sizeof(sysring_hdr_t) + hdr.sr_entries * sizeof(sysring_sqe_t)) {
+        curthr->kt_errno = EINVAL;
+        return -1;
+    }
+    
+    char *sq = (char *)kargs.ring + hdr.sr_sq_off;
+    char *cq = (char *)kargs.ring + hdr.sr_cq_off;
+    uint32_t mask = hdr.sr_entries - 1;
+    
+    while (done < kargs.to_submit
+           && hdr.sr_sq_head != hdr.sr_sq_tail
+           && hdr.sr_cq_tail - hdr.sr_cq_head < hdr.sr_entries
+           && !curthr->kt_cancelled) {
+        if ((err = copy_from_user(&sqe, sq + (hdr.sr_sq_head & mask) * sizeof(sqe), sizeof(sqe))) < 0) {
+            break;
+        }
+        hdr.sr_sq_head++;
+        
+        curthr->kt_errno = 0;
+        cqe.cqe_user_data = sqe.sqe_user_data;
+        if (sysring_allowed(sqe.sqe_sysnum)) {
+            cqe.cqe_ret = syscall_dispatch(sqe.sqe_sysnum, sqe.sqe_args, regs);
+            cqe.cqe_errno = (cqe.cqe_ret == -1) ? curthr->kt_errno : 0;
+        } else {
+            cqe.cqe_ret = -1;
+            cqe.cqe_errno = EINVAL;
+        }
+        
+        if ((err = copy_to_user(cq + (hdr.sr_cq_tail & mask) * sizeof(cqe), &cqe, sizeof(cqe))) < 0) {
+            break;
+        }
+        hdr.sr_cq_tail++;
+        done++;
+    }
+    
+    /* publish only the indices the kernel owns */
+    if (0 > copy_to_user(&kargs.ring->sr_sq_head, &hdr.sr_sq_head, sizeof(uint32_t))
+        || 0 > copy_to_user(&kargs.ring->sr_cq_tail, &hdr.sr_cq_tail, sizeof(uint32_t))) {
+        err = -EFAULT;
+    }
+    
+    if (err < 0 && 0 == done) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+    curthr->kt_errno = 0;
+    return done;
+}
+
 /* Interrupt handler for syscalls */
 static void syscall_handler(regs_t *regs)
 {
@@ -798,7 +1370,9 @@ static void syscall_handler(regs_t *regs)
     
     dbginfo(DBG_VMMAP, vmmap_mapping_info, curproc->p_vmmap);
     
+    uint64_t start = rdtsc();
     int ret = syscall_dispatch(sysnum, args, regs);
+    systat_record(curproc, sysnum, rdtsc() - start, ret == -1);
     
     if (curthr->kt_cancelled) {
         dbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
@@ -810,6 +1384,8 @@ static void syscall_handler(regs_t *regs)
     dbg(DBG_SYSCALL, "<< pid %d, sysnum: %d (%x), returned: %d (%#x)\n",
         curproc->p_pid, sysnum, sysnum, ret, ret);
     regs->r_eax = ret; /* Return value goes in eax */
+    
+    sched_user_return(regs);
 }
 
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
@@ -833,6 +1409,17 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
             sched_switch();
             return 0;
             
+#ifdef __MTP__
+        case SYS_thr_create:
+            return sys_thr_create((thr_create_args_t *)args, regs);
+            
+        case SYS_thr_join:
+            return sys_thr_join((thr_join_args_t *)args);
+            
+        case SYS_thr_detach:
+            return sys_thr_detach((int)args);
+#endif
+            
         case SYS_fork:
             return sys_fork(regs);
             
@@ -869,6 +1456,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
         case SYS_write:
             return sys_write((write_args_t *)args);
             
+        case SYS_readv:
+            return sys_readv((readv_args_t *)args);
+            
+        case SYS_writev:
+            return sys_writev((writev_args_t *)args);
+            
+        case SYS_pread:
+            return sys_pread((pread_args_t *)args);
+            
+        case SYS_pwrite:
+            return sys_pwrite((pwrite_args_t *)args);
+            
         case SYS_dup:
             return sys_dup((int)args);
             
@@ -902,6 +1501,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
         case SYS_lseek:
             return sys_lseek((lseek_args_t *)args);
             
+        case SYS_sendfile:
+            return sys_sendfile((sendfile_args_t *)args);
+            
         case SYS_halt:
             sys_halt();
             return -1;
@@ -926,6 +1528,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
             return sys_debug((argstr_t *)args);
         case SYS_kshell:
             return sys_kshell((int)args);
+            
+        case SYS_ring_setup:
+            return (int) sys_ring_setup((uint32_t)args);
+            
+        case SYS_ring_enter:
+            return sys_ring_enter((ring_enter_args_t *)args, regs);
+            
+        case SYS_nanosleep:
+            return sys_nanosleep((nanosleep_args_t *)args);
+            
+        case SYS_futex:
+            return sys_futex((futex_args_t *)args);
         default:
             dbg(DBG_ERROR, "ERROR: unknown system call: %d (args: %#08x)\n", sysnum, args);
             curthr->kt_errno = ENOSYS;
@@ -0,0 +1,165 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/stats.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/proc.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#include "api/systat.h"
+
+static systat_t systat_global;
+
+static void systat_add(systat_t *ss, uint32_t sysnum, int bucket, int failed)
+{
+        systat_entry_t *se = ss->ss_ent[sysnum];
+
+        if (NULL == se) {
+                /* Losing a sample to a full heap is better than failing
+                 * the syscall it was measuring. */
+                if (NULL == (se = kmalloc(sizeof(*se)))) {
+                        return;
+                }
+                memset(se, 0, sizeof(*se));
+                ss->ss_ent[sysnum] = se;
+        }
+        se->se_calls++;
+        if (failed) {
+                se->se_errors++;
+        }
+        se->se_hist[bucket]++;
+}
+
+void systat_record(proc_t *p, uint32_t sysnum, uint64_t cycles, int failed)
+{
+        int bucket;
+
+        if (sysnum >= SYSTAT_NSYSCALL) {
+                return;
+        }
+        bucket = stats_log2_bucket(cycles, SYSTAT_NBUCKETS);
+
+        systat_add(&systat_global, sysnum, bucket, failed);
+        if (NULL == p->p_systat) {
+                if (NULL == (p->p_systat = kmalloc(sizeof(systat_t)))) {
+                        return;
+                }
+                memset(p->p_systat, 0, sizeof(systat_t));
+        }
+        systat_add(p->p_systat, sysnum, bucket, failed);
+}
+
+void systat_reset(systat_t *ss)
+{
+        int i;
+        for (i = 0; i < SYSTAT_NSYSCALL; i++) {
+                if (NULL != ss->ss_ent[i]) {
+                        memset(ss->ss_ent[i], 0, sizeof(systat_entry_t));
+                }
+        }
+}
+
+void systat_destroy(systat_t *ss)
+{
+        int i;
+        for (i = 0; i < SYSTAT_NSYSCALL; i++) {
+                if (NULL != ss->ss_ent[i]) {
+                        kfree(ss->ss_ent[i]);
+                }
+        }
+        kfree(ss);
+}
+
+/* a used entry of a table, copied out for systat_dump() */
+typedef struct systat_row {
+        int             sr_sysnum;
+        systat_entry_t  sr_ent;
+} systat_row_t;
+
+static void systat_dump(kshell_t *ksh, systat_t *ss)
+{
+        systat_row_t *rows;
+        systat_entry_t *se;
+        int n = 0, i, b;
+
+        /* printing may block, and a process's table is freed when the
+         * process is reaped, so print a snapshot rather than ss itself */
+        for (i = 0; i < SYSTAT_NSYSCALL; i++) {
+                if (NULL != ss->ss_ent[i] && 0 != ss->ss_ent[i]->se_calls) {
+                        n++;
+                }
+        }
+        if (0 == n) {
+                return;
+        }
+        if (NULL == (rows = kmalloc(n * sizeof(*rows)))) {
+                kprintf(ksh, "systat: out of memory\n");
+                return;
+        }
+        n = 0;
+        for (i = 0; i < SYSTAT_NSYSCALL; i++) {
+                if (NULL != ss->ss_ent[i] && 0 != ss->ss_ent[i]->se_calls) {
+                        rows[n].sr_sysnum = i;
+                        rows[n].sr_ent = *ss->ss_ent[i];
+                        n++;
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                se = &rows[i].sr_ent;
+                kprintf(ksh, "sys %3d: %u calls, %u errors\n",
+                        rows[i].sr_sysnum, se->se_calls, se->se_errors);
+                for (b = 0; b < SYSTAT_NBUCKETS; b++) {
+                        if (0 != se->se_hist[b]) {
+                                kprintf(ksh, "    2^%-2d cycles: %u\n",
+                                        b, se->se_hist[b]);
+                        }
+                }
+        }
+        kfree(rows);
+}
+
+/* systat            dump the global table
+ * systat reset      zero the global table
+ * systat <pid>      dump one process's table
+ * systat <pid> reset */
+int systat_kshell(kshell_t *ksh, int argc, char **argv)
+{
+        systat_t *ss = &systat_global;
+        int reset = 0;
+        pid_t pid;
+        int i;
+
+        for (i = 1; i < argc; i++) {
+                if (0 == strcmp(argv[i], "reset")) {
+                        reset = 1;
+                } else if (stats_parse_uint(argv[i], &pid)) {
+                        proc_t *p = proc_lookup(pid);
+                        if (NULL == p) {
+                                kprintf(ksh, "systat: no process %d\n", pid);
+                                return 0;
+                        }
+                        if (NULL == p->p_systat) {
+                                kprintf(ksh, "systat: pid %d has made no syscalls\n", pid);
+                                return 0;
+                        }
+                        ss = p->p_systat;
+                } else {
+                        kprintf(ksh, "usage: systat [pid] [reset]\n");
+                        return 0;
+                }
+        }
+
+        if (reset) {
+                systat_reset(ss);
+        } else {
+                systat_dump(ksh, ss);
+        }
+        return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ *  FILE: dcache.c
+ *  DESC: directory entry cache in front of vn_ops->lookup()
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/debug.h"
+
+#include "mm/slab.h"
+
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/dcache.h"
+
+#define DCACHE_NBUCKETS         256
+#define DCACHE_MAX              1024
+
+typedef struct dcache_entry {
+        struct vnode    *de_dir;
+        struct vnode    *de_vnode;      /* NULL for a negative entry */
+        uint32_t        de_hash;        /* hash of the name alone */
+        size_t          de_namelen;
+        char            de_name[NAME_LEN + 1];
+        list_link_t     de_hlink;       /* on a hash chain */
+        list_link_t     de_lrulink;     /* on dcache_lru, oldest first */
+} dcache_entry_t;
+
+static slab_allocator_t *dcache_allocator;
+
+static list_t dcache_hash[DCACHE_NBUCKETS];
+static list_t dcache_lru;
+static int    dcache_count = 0;
+static uint32_t dcache_gen = 0;
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+        for (i = 0; i < DCACHE_NBUCKETS; i++) {
+                list_init(&dcache_hash[i]);
+        }
+        list_init(&dcache_lru);
+        dcache_allocator = slab_allocator_create("dcache", sizeof(dcache_entry_t));
+        KASSERT(NULL != dcache_allocator);
+}
+init_func(dcache_init);
+
+uint32_t
+dcache_name_hash(const char *name, size_t len)
+{
+        uint32_t h = DCACHE_HASH_INIT;
+        size_t i;
+        for (i = 0; i < len; i++) {
+                h = DCACHE_HASH_STEP(h, name[i]);
+        }
+        return h;
+}
+
+static list_t *
+dcache_bucket(struct vnode *dir, uint32_t hash)
+{
+        return &dcache_hash[(hash ^ ((uint32_t)dir >> 4)) % DCACHE_NBUCKETS];
+}
+
+/* "." and ".." are left to the filesystem, as are names too long to
+ * exist at all. */
+static int
+dcache_cacheable(const char *name, size_t len)
+{
+        if (0 == len || len > NAME_LEN) {
+                return 0;
+        }
+        if ('.' == name[0] && (1 == len || (2 == len && '.' == name[1]))) {
+                return 0;
+        }
+        return 1;
+}
+
+static dcache_entry_t *
+dcache_find(struct vnode *dir, const char *name, size_t len, uint32_t hash)
+{
+        dcache_entry_t *de;
+        list_iterate_begin(dcache_bucket(dir, hash), de, dcache_entry_t, de_hlink) {
+                if (de->de_dir == dir && de->de_hash == hash && de->de_namelen == len
+                    && 0 == strncmp(de->de_name, name, len)) {
+                        return de;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+dcache_unhook(dcache_entry_t *de)
+{
+        list_remove(&de->de_hlink);
+        list_remove(&de->de_lrulink);
+        dcache_count--;
+}
+
+/* Frees an unhooked entry and drops its references. The vputs may
+ * block, so the entry must already be off every list. */
+static void
+dcache_release(dcache_entry_t *de)
+{
+        struct vnode *dir = de->de_dir;
+        struct vnode *vn = de->de_vnode;
+
+        slab_obj_free(dcache_allocator, de);
+        if (NULL != vn) {
+                vput(vn);
+        }
+        vput(dir);
+}
+
+static void
+dcache_drop(dcache_entry_t *de)
+{
+        dcache_unhook(de);
+        dcache_release(de);
+}
+
+/* Drops every entry for which match(de, arg) is true. Matching entries
+ * are all unhooked before any is released so that nothing blocks while
+ * we walk the list. */
+static void
+dcache_purge(int (*match)(dcache_entry_t *de, void *arg), void *arg)
+{
+        dcache_entry_t *de;
+        list_t doomed;
+
+        list_init(&doomed);
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lrulink) {
+                if (match(de, arg)) {
+                        dcache_unhook(de);
+                        list_insert_tail(&doomed, &de->de_lrulink);
+                }
+        } list_iterate_end();
+
+        while (!list_empty(&doomed)) {
+                de = list_head(&doomed, dcache_entry_t, de_lrulink);
+                list_remove(&de->de_lrulink);
+                dcache_release(de);
+        }
+}
+
+/*
+ * Returns 1 if the cache has an answer for (dir, name), where hash is
+ * dcache_name_hash(name, len): *result is then
+ * either the child with its refcount incremented, or NULL if the name is
+ * known not to exist. Returns 0 on a miss.
+ */
+int
+dcache_lookup(struct vnode *dir, const char *name, size_t len, uint32_t hash,
+              struct vnode **result)
+{
+        dcache_entry_t *de;
+
+        if (!dcache_cacheable(name, len)) {
+                return 0;
+        }
+        if (NULL == (de = dcache_find(dir, name, len, hash))) {
+                return 0;
+        }
+
+        list_remove(&de->de_lrulink);
+        list_insert_tail(&dcache_lru, &de->de_lrulink);
+
+        if (NULL != de->de_vnode) {
+                vref(de->de_vnode);
+        }
+        *result = de->de_vnode;
+        return 1;
+}
+
+uint32_t
+dcache_generation(void)
+{
+        return dcache_gen;
+}
+
+/*
+ * Records that (dir, name) resolves to vn, or does not exist if vn is
+ * NULL. gen is what dcache_generation() returned before the lookup that
+ * produced the answer.
+ */
+void
+dcache_enter(struct vnode *dir, const char *name, size_t len, uint32_t hash,
+             struct vnode *vn, uint32_t gen)
+{
+        dcache_entry_t *de;
+
+        if (gen != dcache_gen || !dcache_cacheable(name, len)) {
+                return;
+        }
+        if (NULL != dcache_find(dir, name, len, hash)) {
+                return;
+        }
+
+        if (dcache_count >= DCACHE_MAX) {
+                dcache_drop(list_head(&dcache_lru, dcache_entry_t, de_lrulink));
+                /* the vputs may have blocked */
+                if (gen != dcache_gen || NULL != dcache_find(dir, name, len, hash)) {
+                        return;
+                }
+        }
+
+        if (NULL == (de = slab_obj_alloc(dcache_allocator))) {
+                return;
+        }
+        de->de_dir = dir;
+        de->de_vnode = vn;
+        de->de_hash = hash;
+        de->de_namelen = len;
+        strncpy(de->de_name, name, len);
+        de->de_name[len] = '\0';
+
+        vref(dir);
+        if (NULL != vn) {
+                vref(vn);
+        }
+        list_link_init(&de->de_hlink);
+        list_link_init(&de->de_lrulink);
+        list_insert_head(dcache_bucket(dir, hash), &de->de_hlink);
+        list_insert_tail(&dcache_lru, &de->de_lrulink);
+        dcache_count++;
+}
+
+static int
+dcache_match_dir(dcache_entry_t *de, void *arg)
+{
+        return de->de_dir == (struct vnode *)arg;
+}
+
+/*
+ * Forgets whatever is cached for (dir, name). If it was a directory,
+ * entries cached under it go too, so that a removed directory is not
+ * kept alive by its negative entries.
+ */
+void
+dcache_invalidate(struct vnode *dir, const char *name, size_t len)
+{
+        dcache_entry_t *de;
+        struct vnode *vn;
+
+        dcache_gen++;
+        if (!dcache_cacheable(name, len)) {
+                return;
+        }
+        if (NULL == (de = dcache_find(dir, name, len, dcache_name_hash(name, len)))) {
+                return;
+        }
+
+        vn = de->de_vnode;
+        if (NULL != vn && S_IFDIR == vn->vn_mode) {
+                vref(vn);
+                dcache_drop(de);
+                dcache_purge(dcache_match_dir, vn);
+                vput(vn);
+        } else {
+                dcache_drop(de);
+        }
+}
+
+static int
+dcache_match_fs(dcache_entry_t *de, void *arg)
+{
+        return de->de_dir->vn_fs == (struct fs *)arg;
+}
+
+static int
+dcache_match_all(dcache_entry_t *de, void *arg)
+{
+        return 1;
+}
+
+/* Called from vfs_is_in_use() so that cached entries do not keep an
+ * unmounting filesystem's vnodes busy. */
+void
+dcache_purge_fs(struct fs *fs)
+{
+        dcache_gen++;
+        dcache_purge(dcache_match_fs, fs);
+}
+
+void
+dcache_purge_all(void)
+{
+        dcache_gen++;
+        dcache_purge(dcache_match_all, NULL);
+}
@@ -0,0 +1,204 @@
+/*
+ *  FILE: fdtable.c
+ *  DESC: growable per-process file descriptor tables
+ */
+
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/proc.h"
+
+#include "fs/file.h"
+#include "fs/fdtable.h"
+
+#define FDMAP_WORDS(n)          (((n) + 31) / 32)
+#define FDMAP_TEST(map, fd)     ((map)[(fd) / 32] & (1u << ((fd) % 32)))
+#define FDMAP_SET(map, fd)      ((map)[(fd) / 32] |= (1u << ((fd) % 32)))
+#define FDMAP_CLR(map, fd)      ((map)[(fd) / 32] &= ~(1u << ((fd) % 32)))
+
+int
+fdtable_init(proc_t *p)
+{
+        p->p_nfiles = NFILES;
+        p->p_fdhint = 0;
+        p->p_files = kmalloc(NFILES * sizeof(file_t *));
+        p->p_fdmap = kmalloc(FDMAP_WORDS(NFILES) * sizeof(uint32_t));
+        if (NULL == p->p_files || NULL == p->p_fdmap) {
+                fdtable_destroy(p);
+                return -ENOMEM;
+        }
+        memset(p->p_files, 0, NFILES * sizeof(file_t *));
+        memset(p->p_fdmap, 0, FDMAP_WORDS(NFILES) * sizeof(uint32_t));
+        return 0;
+}
+
+/* Frees the table itself; every descriptor must already be closed. */
+void
+fdtable_destroy(proc_t *p)
+{
+        if (NULL != p->p_files) {
+                kfree(p->p_files);
+        }
+        if (NULL != p->p_fdmap) {
+                kfree(p->p_fdmap);
+        }
+        p->p_files = NULL;
+        p->p_fdmap = NULL;
+        p->p_nfiles = 0;
+}
+
+/* Grows p's table to at least n slots, doubling each time from at least
+ * NFILES (a destroyed table has none). The old arrays are not touched
+ * until the new ones are ready, so on failure the table is unchanged. */
+static int
+fdtable_grow(proc_t *p, int n)
+{
+        int size = (p->p_nfiles > NFILES) ? p->p_nfiles : NFILES;
+        file_t **files;
+        uint32_t *map;
+
+        if (n > FDTABLE_MAX) {
+                return -EMFILE;
+        }
+        while (size < n) {
+                size *= 2;
+        }
+        if (size > FDTABLE_MAX) {
+                size = FDTABLE_MAX;
+        }
+
+        files = kmalloc(size * sizeof(file_t *));
+        map = kmalloc(FDMAP_WORDS(size) * sizeof(uint32_t));
+        if (NULL == files || NULL == map) {
+                if (NULL != files) {
+                        kfree(files);
+                }
+                if (NULL != map) {
+                        kfree(map);
+                }
+                return -ENOMEM;
+        }
+
+        memset(files, 0, size * sizeof(file_t *));
+        memset(map, 0, FDMAP_WORDS(size) * sizeof(uint32_t));
+        memcpy(files, p->p_files, p->p_nfiles * sizeof(file_t *));
+        memcpy(map, p->p_fdmap, FDMAP_WORDS(p->p_nfiles) * sizeof(uint32_t));
+
+        kfree(p->p_files);
+        kfree(p->p_fdmap);
+        p->p_files = files;
+        p->p_fdmap = map;
+        p->p_nfiles = size;
+        return 0;
+}
+
+/* Makes fd a valid slot in p's table, growing it if need be. */
+int
+fdtable_reserve(proc_t *p, int fd)
+{
+        if (fd < 0 || fd >= FDTABLE_MAX) {
+                return -EBADF;
+        }
+        if (fd < p->p_nfiles) {
+                return 0;
+        }
+        return fdtable_grow(p, fd + 1);
+}
+
+/* Returns the lowest free descriptor >= minfd and marks it used, growing
+ * the table if every slot is taken. */
+int
+fdtable_alloc(proc_t *p, int minfd)
+{
+        int fd = (minfd > p->p_fdhint) ? minfd : p->p_fdhint;
+        int err;
+
+        for (;;) {
+                while (fd < p->p_nfiles) {
+                        uint32_t free = ~p->p_fdmap[fd / 32] & (~0u << (fd % 32));
+                        if (0 != free) {
+                                fd = (fd & ~31) + __builtin_ctz(free);
+                                if (fd >= p->p_nfiles) {
+                                        break;
+                                }
+                                FDMAP_SET(p->p_fdmap, fd);
+                                if (fd == p->p_fdhint) {
+                                        p->p_fdhint = fd + 1;
+                                }
+                                return fd;
+                        }
+                        fd = (fd & ~31) + 32;
+                }
+
+                fd = p->p_nfiles;
+                if (0 > (err = fdtable_grow(p, fd + 1))) {
+                        dbg(DBG_ERROR | DBG_VFS, "ERROR: fdtable_alloc: out of file descriptors "
+                            "for pid %d\n", p->p_pid);
+                        return err;
+                }
+        }
+}
+
+/* Puts f in slot fd, which must already be within the table. */
+void
+fdtable_install(proc_t *p, int fd, file_t *f)
+{
+        KASSERT(0 <= fd && fd < p->p_nfiles);
+        p->p_files[fd] = f;
+        FDMAP_SET(p->p_fdmap, fd);
+        if (fd == p->p_fdhint) {
+                p->p_fdhint = fd + 1;
+        }
+}
+
+/* Empties slot fd. Does not fput the file that was there. */
+void
+fdtable_clear(proc_t *p, int fd)
+{
+        KASSERT(0 <= fd && fd < p->p_nfiles);
+        p->p_files[fd] = NULL;
+        FDMAP_CLR(p->p_fdmap, fd);
+        if (fd < p->p_fdhint) {
+                p->p_fdhint = fd;
+        }
+}
+
+/* Returns the lowest used descriptor >= fd, or -1 if there is none. */
+int
+fdtable_next(proc_t *p, int fd)
+{
+        while (fd < p->p_nfiles) {
+                uint32_t used = p->p_fdmap[fd / 32] & (~0u << (fd % 32));
+                if (0 != used) {
+                        fd = (fd & ~31) + __builtin_ctz(used);
+                        return (fd < p->p_nfiles) ? fd : -1;
+                }
+                fd = (fd & ~31) + 32;
+        }
+        return -1;
+}
+
+/* Gives dst a reference to every open file in src at the same
+ * descriptor, for fork. Only used slots are visited. */
+int
+fdtable_copy(proc_t *dst, proc_t *src)
+{
+        int fd, err;
+
+        if (dst->p_nfiles < src->p_nfiles
+            && 0 > (err = fdtable_grow(dst, src->p_nfiles))) {
+                return err;
+        }
+        for (fd = fdtable_next(src, 0); fd >= 0; fd = fdtable_next(src, fd + 1)) {
+                if (NULL != src->p_files[fd]) {
+                        fref(src->p_files[fd]);
+                        fdtable_install(dst, fd, src->p_files[fd]);
+                }
+        }
+        return 0;
+}
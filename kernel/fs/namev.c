@@ -12,6 +12,9 @@
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
+#include "fs/dcache.h"
+
+#include "proc/krwlock.h"
 
 /* This takes a base 'dir', a 'name', its 'len', and a result vnode.
  * Most of the work should be done by the vnode's implementation
@@ -21,9 +24,13 @@
  * If dir has no lookup(), return -ENOTDIR.
  *
  * Note: returns with the vnode refcount on *result incremented.
+ *
+ * lookup_hashed() takes the name's dcache_name_hash() from a caller that
+ * already has it; lookup() computes it.
  */
 int
-lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+lookup_hashed(vnode_t *dir, const char *name, size_t len, uint32_t hash,
+              vnode_t **result)
 {
     
     /* grading guideline required */
@@ -50,12 +57,137 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
     /* ATTENTION! We don't handle special case . or .. here. */
     /* Comment implies the '.' and '..' are handled by vnode's implementation specific lookup()*/
     
+    /* try the dentry cache first; a hit comes back already vref'd */
+    if (dcache_lookup(dir, name, len, hash, result)) {
+        return (*result != NULL) ? 0 : -ENOENT;
+    }
+    
     /* result's refcount will be incremented here, by the specific lookup() */
     /* So we know, if there is any error returned, the refcount isn't incremented! */
-    return dir->vn_ops->lookup(dir, name, len, result);
+    uint32_t gen = dcache_generation();
+    krwlock_rdlock(&dir->vn_rwlock);
+    int ret = dir->vn_ops->lookup(dir, name, len, result);
+    krwlock_rdunlock(&dir->vn_rwlock);
+    if (ret == 0) {
+        dcache_enter(dir, name, len, hash, *result, gen);
+    } else if (ret == -ENOENT) {
+        dcache_enter(dir, name, len, hash, NULL, gen);
+    }
+    return ret;
+}
+
+int
+lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+{
+    KASSERT(NULL != name);
+    return lookup_hashed(dir, name, len, dcache_name_hash(name, len), result);
 }
 
 
+/* Resolves pathname in a single pass over the string, without copying it.
+ * Each component is hashed as it is scanned and the hash goes straight to
+ * the dentry cache. On success:
+ *  o *res_parent is the directory that holds the last component, with its
+ *    refcount incremented
+ *  o *name and *namelen give the last component, pointing into pathname, with
+ *    any trailing slashes left off
+ *  o if res_leaf is not NULL, *res_leaf is the last component's vnode
+ *    with its refcount incremented, or NULL if it does not exist
+ *
+ * A path made only of slashes names the root: *name is NULL, *namelen is
+ * 0, and the parent and leaf are both vfs_root_vn.
+ *
+ * On error no references are held.
+ */
+int
+namev_walk(const char *pathname, vnode_t *base, vnode_t **res_parent,
+           const char **name, size_t *namelen, vnode_t **res_leaf)
+{
+    vnode_t *dir;
+    vnode_t *next;
+    const char *p = pathname;
+    const char *comp;
+    size_t len;
+    uint32_t hash;
+    int ret;
+    
+    if (*p == '\0') {
+        return -EINVAL;
+    }
+    
+    if (*p == '/') {
+        dir = vfs_root_vn;
+    } else if (base != NULL) {
+        dir = base;
+    } else {
+        dir = curproc->p_cwd;
+    }
+    vref(dir);
+    
+    while (*p == '/') {
+        p++;
+    }
+    if (*p == '\0') {
+        /* all slashes */
+        *res_parent = dir;
+        *name = NULL;
+        *namelen = 0;
+        if (res_leaf != NULL) {
+            vref(dir);
+            *res_leaf = dir;
+        }
+        return 0;
+    }
+    
+    for (;;) {
+        comp = p;
+        hash = DCACHE_HASH_INIT;
+        while (*p != '/' && *p != '\0') {
+            hash = DCACHE_HASH_STEP(hash, *p);
+            p++;
+        }
+        len = p - comp;
+        while (*p == '/') {
+            p++;
+        }
+        
+        if ((size_t)(p - pathname) > MAXPATHLEN) {
+            vput(dir);
+            return -EINVAL;
+        }
+        if (len > NAME_LEN) {
+            vput(dir);
+            return -ENAMETOOLONG;
+        }
+        
+        if (*p == '\0') {
+            break;
+        }
+        
+        ret = lookup_hashed(dir, comp, len, hash, &next);
+        vput(dir);
+        if (ret) {
+            return ret;
+        }
+        dir = next;
+    }
+    
+    if (res_leaf != NULL) {
+        ret = lookup_hashed(dir, comp, len, hash, res_leaf);
+        if (ret == -ENOENT) {
+            *res_leaf = NULL;
+        } else if (ret) {
+            vput(dir);
+            return ret;
+        }
+    }
+    
+    *res_parent = dir;
+    *name = comp;
+    *namelen = len;
+    return 0;
+}
+
 /* When successful this function returns data in the following "out"-arguments:
  *  o res_vnode: the vnode of the parent directory of "name"
  *  o name: the `basename' (the element of the pathname)
@@ -96,164 +228,15 @@ dir_namev(const char *pathname, size_t *namelen, const char **name,
     KASSERT(NULL != res_vnode);
     dbg(DBG_PRINT,"(GRADING2A 2.b) The res_vnode is not NULL. \n");
     
-    
-    /* local variables */
-    vnode_t *curPathBase = NULL;
-    vnode_t *nextPathBase = NULL;
-    /*Fix my Manan - pathnameCopy changed from char pointer to char array.*/
-    char pathnameCopy[MAXPATHLEN + 1];
-    char *curComName = NULL;
-    char *nextComName = NULL;
-    int singleFilename = 1;
-    int needToDecrease = 0;
-    
-    /* make sure pathname is not NULL */
-    if (pathname == NULL) {
-        dbg(DBG_PRINT,"The path name is null\n");
-        return -EINVAL;
-    }
-    
-    /* check the length of the whole pathname is OK */
-    size_t pathnameLen = strnlen(pathname, MAXPATHLEN + 1);
-    dbg(DBG_PRINT,"The pathname length is %d\n", (int)pathnameLen);
-    if (pathnameLen > MAXPATHLEN || pathnameLen <= 0) {
-        dbg(DBG_PRINT,"The pathname is too long\n");
-        return -EINVAL;
-    }
-    
-    /* copy the pathname to pathnameCopy, get ready to process pathname */
-    strncpy(pathnameCopy, pathname, pathnameLen);
-    
-    /* get the start position of pathnameCopy */
-    char *startPoint = pathnameCopy;
-
-    /*Fix by Manan - Making the last character as '\0'*/
-    pathnameCopy[pathnameLen] = '\0';
-    
-    /* set the correct curPathBase */
-    if (pathnameCopy[0] == '/') {
-        dbg(DBG_PRINT,"pathname starts with a '/'. So ignore *base\n");
-        curPathBase = vfs_root_vn;
-    } else {
-        if (base != NULL) {
-            dbg(DBG_PRINT,"pathname does not start with a '/' and base != NULL. So *base is used.\n");
-            curPathBase = base;
-        } else {
-            dbg(DBG_PRINT,"pathname does not start with a '/' and base == NULL. So base = curproc->p_cwd.\n");
-            curPathBase = curproc->p_cwd;
-        }
-    }
-    
-    int allAreSlashes = 1;
-    char *runner = pathnameCopy;
-    while (*runner != '\0') {
-        if (*runner != '/') {
-            allAreSlashes = 0;
-            break;
-        }
-        /*Fix by Manan - runner was never incrementing... hence hung
-         * here inifinitely earlier*/
-        runner++;
-    }
-    
-    /* if all are slashes, we need to handle root case */
-    if (allAreSlashes) {
-        dbg(DBG_PRINT,"All characters of pathname = %s are slashes\n", pathnameCopy);
-        vref(vfs_root_vn);
-        *res_vnode = vfs_root_vn;
-        /* KZTODO: not sure what should be set here, null or '/'? But our implementation should work.*/
-        *name = NULL;
-        *namelen = 0;
-        return 0;
-    }
-    
-    curComName = pathnameCopy;
-    
-    /* locate the first component name */
-    while (*curComName == '/') {
-        curComName++;
-    }
-    
-    /* delete all the tail '/'s */
-    char *end = pathnameCopy + pathnameLen - 1;
-    while (*end == '/') {
-        *end = '\0';
-        end--;
-    }
-    dbg(DBG_PRINT,"All trailing slashes removed\n");
-    dbg(DBG_PRINT,"Now pathnameCopy = %s\n", pathnameCopy);
-
-    
-    nextComName = curComName;
-    while (*nextComName != '/' && *nextComName != '\0') {
-        nextComName++;
-    }
-    
-    while (*nextComName != '\0') {
-        /* locate the next component name */
-        while (*nextComName == '/') {
-            *nextComName = '\0';
-            nextComName++;
-        }
-        
-        size_t comNameLen = strnlen(curComName, NAME_LEN + 1);
-        if (comNameLen > NAME_LEN) {
-            return -ENAMETOOLONG;
-        }
-    
-        dbg(DBG_PRINT,"Object of name %s of length %d\n", curComName, comNameLen);
-        int lookupResult = lookup(curPathBase, curComName, comNameLen, &nextPathBase);
-        
-        /* TODO: may need to change place */
-        if (needToDecrease) {
-            vput(curPathBase);
-        }
-        
-        if (lookupResult) {
-            return lookupResult;
-        }
-        
-        curPathBase = nextPathBase;
-        curComName = nextComName;
-        while (*nextComName != '/' && *nextComName != '\0') {
-            nextComName++;
-        }
-        
-        needToDecrease = 1;
-        singleFilename = 0;
-    }
-    
-    size_t comNameLen = strnlen(curComName, NAME_LEN + 1);
-    
-    
-    if (singleFilename) {
-        vref(curPathBase);
-    }
-    
-    if (comNameLen > NAME_LEN) {
-        vput(curPathBase);
-        return -ENAMETOOLONG;
+    int ret = namev_walk(pathname, base, res_vnode, name, namelen, NULL);
+    if (ret) {
+        return ret;
     }
     
     /* grading guideline required */
-    KASSERT(NULL != curPathBase);
+    KASSERT(NULL != *res_vnode);
     dbg(DBG_PRINT,"(GRADING2A 2.b) The corresponding vnode is not NULL. \n");
     
-    *res_vnode = curPathBase;
-    
-    /* Now, we don't need to use kmalloc. */
-    int offset = curComName - startPoint;
-    *name = pathname + offset;
-    *namelen = comNameLen;
-    
-    
-    /* 
-    char *resultName =(char *) kmalloc( strnlen(curComName, NAME_LEN + 1) * sizeof(char));
-    strncpy(resultName, curComName, NAME_LEN + 1);
-    *name = resultName;
-    *namelen = strnlen(curComName, NAME_LEN + 1);
-     */
-    
     return 0;
 }
 
@@ -276,43 +259,36 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
     const char *name;
     vnode_t *parent;
     
-    int retval = dir_namev(pathname, &len, &name, base, &parent);
+    /* one walk gives us both the parent and the leaf */
+    int retval = namev_walk(pathname, base, &parent, &name, &len, res_vnode);
     
     if(retval) {
-        dbg(DBG_PRINT,"ERROR!!! Call to open_namev->dir_namev has returned the below.\n%s\n", strerror(-retval));
+        dbg(DBG_PRINT,"ERROR!!! Call to open_namev->namev_walk has returned the below.\n%s\n", strerror(-retval));
         return retval;
     }
     
-    /* handle root case */
-    if (name == NULL && len == 0) {
-        *res_vnode = vfs_root_vn;
-        /* Corrected: need to increment the refcounting of root vnode */
-        vref(*res_vnode);
+    if (*res_vnode != NULL) {
         vput(parent);
         return 0;
     }
     
-    retval = lookup(parent, name, len, res_vnode);
-    
-    if (retval == -ENOENT && ((flag & O_CREAT) != 0x100)) {
-        dbg(DBG_PRINT,"ERROR!!! Call to open_namev->lookup has returned -ENOENT and the flag does not have O_CREAT. So returning below\n%s\n", strerror(-retval));
+    if ((flag & O_CREAT) != O_CREAT) {
+        dbg(DBG_PRINT,"ERROR!!! Call to open_namev->lookup has returned -ENOENT and the flag does not have O_CREAT. So returning below\n%s\n", strerror(ENOENT));
         vput(parent);
         return -ENOENT;
     }
     
-    if(retval == -ENOENT && (flag & O_CREAT)) {
-        /* grading guideline required */
-        KASSERT(NULL != parent->vn_ops->create);
-        dbg(DBG_PRINT,"(GRADING2A 2.c) The corresponding vnode has create function. \n");
-        
-        retval = parent->vn_ops->create(parent, name, len, res_vnode);
-        if (retval < 0){
+    /* grading guideline required */
+    KASSERT(NULL != parent->vn_ops->create);
+    dbg(DBG_PRINT,"(GRADING2A 2.c) The corresponding vnode has create function. \n");
+    
+    krwlock_wrlock(&parent->vn_rwlock);
+    retval = parent->vn_ops->create(parent, name, len, res_vnode);
+    krwlock_wrunlock(&parent->vn_rwlock);
+    dcache_invalidate(parent, name, len);
+    if (retval < 0){
         dbg(DBG_PRINT,"ERROR!!! Call to open_namev->parent->vn_ops->create has returned the below.\n%s\n", strerror(-retval));
-        }
-        vput(parent);
-        return retval;
     }
-    
     vput(parent);
     return retval;
 }
@@ -16,22 +16,16 @@
 #include "fs/vfs_syscall.h"
 #include "fs/open.h"
 #include "fs/stat.h"
+#include "fs/fdtable.h"
 #include "util/debug.h"
 
-/* find empty index in p->p_files[] */
+/* Find the lowest empty index in p->p_files[], growing the table if it is
+ * full. The slot is reserved for the caller, who must either fill it in
+ * with fdtable_install() or release it with fdtable_clear(). */
 int
 get_empty_fd(proc_t *p)
 {
-        int fd;
-
-        for (fd = 0; fd < NFILES; fd++) {
-                if (!p->p_files[fd])
-                        return fd;
-        }
-
-        dbg(DBG_ERROR | DBG_VFS, "ERROR: get_empty_fd: out of file descriptors "
-            "for pid %d\n", curproc->p_pid);
-        return -EMFILE;
+        return fdtable_alloc(p, 0);
 }
 
 /*
@@ -117,19 +111,20 @@ do_open(const char *filename, int oflags)
     
     /*      1. Get the next empty file descriptor.*/
     int new_fd = get_empty_fd(curproc);
-    if (new_fd == -EMFILE){
-        return -EMFILE;
+    if (new_fd < 0){
+        return new_fd;
     }
  
     /*      2. Call fget to get a fresh file_t.*/
     file_t *new_file_t = fget(-1); /* -1 is passed as argument to get a new file object. */
     if (new_file_t == NULL) {
         dbg(DBG_PRINT,"ERROR!!! Insufficient memory returned by fget.\n");
+        fdtable_clear(curproc, new_fd);
         return -ENOMEM;
     }
  
     /*      3. Save the file_t in curproc's file descriptor table.*/
-    curproc->p_files[new_fd] = new_file_t;
+    fdtable_install(curproc, new_fd, new_file_t);
 
     /*      4. Set file_t->f_mode to OR of FMODE_(READ|WRITE|APPEND) based on
           oflags, which can be O_RDONLY, O_WRONLY or O_RDWR, possibly OR'd with
@@ -164,7 +159,7 @@ do_open(const char *filename, int oflags)
     int ret = open_namev(filename, oflags, &result_vnode, NULL);
     if (ret) {
         fput(new_file_t);
-        curproc->p_files[new_fd] = NULL;
+        fdtable_clear(curproc, new_fd);
         dbg(DBG_PRINT,"Call to do_open->open_namev returned the below \n%s\n", strerror(-ret));
         return ret;
     }
@@ -176,7 +171,7 @@ do_open(const char *filename, int oflags)
     if(S_ISDIR( result_vnode->vn_mode ) && ( new_file_t->f_mode & FMODE_WRITE )){
         dbg(DBG_PRINT,"ERROR!!! pathname refers to a directory and the access requested involved writing (that is, O_WRONLY or O_RDWR is set).\n");
         fput(new_file_t);
-        curproc->p_files[new_fd] = NULL;
+        fdtable_clear(curproc, new_fd);
         dbg(DBG_PRINT,"Returning the below\n%s\n", strerror(EISDIR));
         return -EISDIR;
     }
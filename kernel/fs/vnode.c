@@ -13,15 +13,48 @@
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
+#include "fs/dcache.h"
 #include "mm/slab.h"
+#include "mm/kmalloc.h"
 #include "proc/sched.h"
+#include "proc/krwlock.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
 #include "globals.h"
 
 static slab_allocator_t *vnode_allocator;
 
-static list_t vnode_inuse_list;
+/*
+ * Active vnodes are hashed on (fs, vno) so that vget can find them
+ * without a scan. Each is also on the vnode list of its filesystem
+ * (through vn_link) for the per-fs walks done at unmount and shutdown.
+ * There are only ever a handful of filesystems, so those lists are kept
+ * here rather than in fs_t.
+ */
+#define VNODE_HASH_SIZE 256
+
+typedef struct vnode_fslist {
+        struct fs       *vf_fs;
+        list_t          vf_vnodes;
+        int             vf_count;
+        list_link_t     vf_link;        /* on vnode_fslists */
+} vnode_fslist_t;
+
+static list_t vnode_hash[VNODE_HASH_SIZE];
+static list_t vnode_fslists;
+
+/*
+ * Inactive vnodes: vnodes with no references that are still linked in
+ * their fs. They stay in the hash with a refcount of 0 so that vget can
+ * hand them back without going to the fs, and sit on vnode_inactive_list
+ * (through vn_lrulink), least recently used first. The list is capped
+ * at VNODE_INACTIVE_MAX, and pageoutd empties it when memory is short.
+ * Since resident pages hold references, an inactive vnode never has any.
+ */
+#define VNODE_INACTIVE_MAX 128
+
+static list_t vnode_inactive_list;
+static int vnode_ninactive = 0;
 
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
@@ -63,6 +96,7 @@ static vnode_ops_t bytedev_spec_vops = {
         .mkdir = NULL,
         .rmdir = NULL,
         .readdir = NULL,
+        .getdents = NULL,
         .stat = special_file_stat,
         .fillpage = special_file_fillpage,
         .dirtypage = special_file_dirtypage,
@@ -81,6 +115,7 @@ static vnode_ops_t blockdev_spec_vops = {
         .mkdir = NULL,
         .rmdir = NULL,
         .readdir = NULL,
+        .getdents = NULL,
         .stat = special_file_stat,
         .fillpage = NULL,
         .dirtypage = NULL,
@@ -93,11 +128,143 @@ static vnode_ops_t blockdev_spec_vops = {
 static __attribute__((unused)) void
 vnode_init(void)
 {
-        list_init(&vnode_inuse_list);
+        int i;
+        for (i = 0; i < VNODE_HASH_SIZE; i++)
+                list_init(&vnode_hash[i]);
+        list_init(&vnode_fslists);
+        list_init(&vnode_inactive_list);
         vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
 }
 init_func(vnode_init);
 
+static list_t *
+vnode_bucket(struct fs *fs, ino_t vno)
+{
+        uint32_t h = ((uint32_t)fs >> 4) ^ ((uint32_t)vno * 2654435761u);
+        return &vnode_hash[h % VNODE_HASH_SIZE];
+}
+
+/* Returns the vnode list of fs, creating it if asked to. Returns NULL
+ * if fs has no active vnodes and create is 0, or if we are out of
+ * memory. */
+static vnode_fslist_t *
+vnode_fslist(struct fs *fs, int create)
+{
+        vnode_fslist_t *fl;
+
+        list_iterate_begin(&vnode_fslists, fl, vnode_fslist_t, vf_link) {
+                if (fl->vf_fs == fs)
+                        return fl;
+        } list_iterate_end();
+
+        if (!create || NULL == (fl = kmalloc(sizeof(vnode_fslist_t))))
+                return NULL;
+        fl->vf_fs = fs;
+        list_init(&fl->vf_vnodes);
+        fl->vf_count = 0;
+        list_link_init(&fl->vf_link);
+        list_insert_tail(&vnode_fslists, &fl->vf_link);
+        return fl;
+}
+
+/* Drops one count from fl, freeing it when the fs has no vnodes left. */
+static void
+vnode_fslist_put(vnode_fslist_t *fl)
+{
+        KASSERT(0 < fl->vf_count);
+        if (0 == --fl->vf_count) {
+                list_remove(&fl->vf_link);
+                kfree(fl);
+        }
+}
+
+/* Frees an unreferenced vnode: gives it back to its fs and takes it out
+ * of the hash and its fs's list. */
+static void
+vnode_delete(vnode_t *vn)
+{
+        vnode_fslist_t *fl;
+
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(0 == vn->vn_nrespages);
+
+        vn->vn_flags |= VN_BUSY;
+        if (vn->vn_fs->fs_op->delete_vnode) {
+                vn->vn_fs->fs_op->delete_vnode(vn);
+        }
+        /* (really no need to clear VN_BUSY): */
+
+#ifndef NDEBUG
+        if (!sched_queue_empty(&vn->vn_waitq)) {
+                dbg(DBG_VNREF, "vput: wow, found thread(s) trying to vget "
+                    "(%p, %p ino %ld) after returning from delete_vnode.\n",
+                    vn, vn->vn_fs, (long)vn->vn_vno);
+        }
+#endif
+
+        /* wake up anyone who might have attempted to vget this vnode while
+         * we were taking it away: */
+        sched_broadcast_on(&vn->vn_waitq);
+
+        list_remove(&vn->vn_hlink);
+        list_remove(&vn->vn_link); /* remove from its fs's list */
+        fl = vnode_fslist(vn->vn_fs, 0);
+        KASSERT(fl);
+        vnode_fslist_put(fl);
+        kmutex_destroy(&vn->vn_mutex);
+        slab_obj_free(vnode_allocator, vn);
+}
+
+static void
+vnode_inactivate(vnode_t *vn)
+{
+        vnode_t *old;
+
+        list_insert_tail(&vnode_inactive_list, &vn->vn_lrulink);
+        if (++vnode_ninactive > VNODE_INACTIVE_MAX) {
+                old = list_head(&vnode_inactive_list, vnode_t, vn_lrulink);
+                list_remove(&old->vn_lrulink);
+                vnode_ninactive--;
+                vnode_delete(old);
+        }
+}
+
+/* Frees up to n inactive vnodes, oldest first, or all of them if n is
+ * negative. Returns how many were freed. */
+int
+vnode_reclaim_inactive(int n)
+{
+        vnode_t *vn;
+        int freed = 0;
+
+        while (freed != n && !list_empty(&vnode_inactive_list)) {
+                vn = list_head(&vnode_inactive_list, vnode_t, vn_lrulink);
+                list_remove(&vn->vn_lrulink);
+                vnode_ninactive--;
+                vnode_delete(vn);
+                freed++;
+        }
+        return freed;
+}
+
+/* Frees the inactive vnodes of fs, which is about to go away. */
+static void
+vnode_purge_inactive(struct fs *fs)
+{
+        vnode_t *vn;
+
+again:
+        list_iterate_begin(&vnode_inactive_list, vn, vnode_t, vn_lrulink) {
+                if (vn->vn_fs == fs) {
+                        list_remove(&vn->vn_lrulink);
+                        vnode_ninactive--;
+                        /* this may block and change the list */
+                        vnode_delete(vn);
+                        goto again;
+                }
+        } list_iterate_end();
+}
+
 /*
  * Core vnode management routines:
  */
@@ -115,12 +282,13 @@ vnode_t *
 vget(struct fs *fs, ino_t vno)
 {
         vnode_t *vn = NULL;
+        vnode_fslist_t *fl;
 
         KASSERT(fs);
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        list_iterate_begin(vnode_bucket(fs, vno), vn, vnode_t, vn_hlink) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -135,6 +303,18 @@ find:
                                 goto find;
                         }
 
+                        if (0 == vn->vn_refcount) {
+                                /* inactive: bring it back without asking
+                                 * the fs. Nothing is mounted on it, or it
+                                 * would be referenced. */
+                                list_remove(&vn->vn_lrulink);
+                                vnode_ninactive--;
+                                vn->vn_refcount = 1;
+                                dbg(DBG_VNREF, "vget: revived inactive vnode (0x%p, 0x%p ino %ld)\n",
+                                    vn, vn->vn_fs, (long)vn->vn_vno);
+                                return vn;
+                        }
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -152,8 +332,13 @@ find:
 
         /* if we got here, we didn't find the vnode. */
         /*   alloc a new vnode: */
+        /* the vnode first: a list created for it must not be left empty */
         vn = slab_obj_alloc(vnode_allocator);
-        if (!vn) {
+        fl = vn ? vnode_fslist(fs, 1) : NULL;
+        if (!fl) {
+                if (vn) {
+                        slab_obj_free(vnode_allocator, vn);
+                }
                 dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                     "will then re-attempt to vget vnode later %d of fs %p\n", vno, fs);
                 sched_make_runnable(curthr);
@@ -166,6 +351,8 @@ find:
         vn->vn_fs = fs;
         vn->vn_vno = vno;
         kmutex_init(&vn->vn_mutex);
+        kmutex_set_name(&vn->vn_mutex, "vnode");
+        krwlock_init(&vn->vn_rwlock);
         mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
         sched_queue_init(&vn->vn_waitq);
 
@@ -177,14 +364,16 @@ find:
          *     vn_mode, vn_len, vn_i, and vn_devid (if
          *     appropriate)): */
 
-        /*       mark it busy and place it on vnode_inuse_list (so it can
+        /*       mark it busy and place it in the hash (so it can
          *       be found while we are possibly blocking): (also, seems
          *       appropriate not to ref it yet since no references from
          *       outside this context (vnode.c) will exist until we are
          *       done bringing the vnode in)
          */
         vn->vn_flags |= VN_BUSY;
-        list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head(vnode_bucket(fs, vno), &vn->vn_hlink);
+        list_insert_head(&fl->vf_vnodes, &vn->vn_link);
+        fl->vf_count++;
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -276,30 +465,17 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
 
-        vn->vn_flags |= VN_BUSY;
-        if (vn->vn_fs->fs_op->delete_vnode) {
-                vn->vn_fs->fs_op->delete_vnode(vn);
-        }
-        /* (really no need to clear VN_BUSY): */
-
-#ifndef NDEBUG
-        if (!sched_queue_empty(&vn->vn_waitq)) {
-                dbg(DBG_VNREF, "vput: wow, found thread(s) trying to vget "
-                    "(%p, %p ino %ld) after returning from delete_vnode.\n",
-                    vn, vn->vn_fs, (long)vn->vn_vno);
+        /* if it is still linked, keep it in case someone wants it again
+         * soon; otherwise free the vnode */
+        if (vn != vn->vn_fs->fs_root && vn->vn_fs->fs_op->query_vnode(vn)) {
+                vnode_inactivate(vn);
+                return;
         }
-#endif
-
-        /* wake up anyone who might have attempted to vget this vnode while
-         * we were taking it away: */
-        sched_broadcast_on(&vn->vn_waitq);
-
-        list_remove(&vn->vn_link); /* remove from vn_inuse_list */
-        slab_obj_free(vnode_allocator, vn);
+        vnode_delete(vn);
 }
 
 int
@@ -319,20 +495,27 @@ vfs_is_in_use(fs_t *fs)
          *             - return -EBUSY
          *
          */
-        list_t *list = &vnode_inuse_list;
+        vnode_fslist_t *fl;
+        list_t *list;
         list_link_t *link;
         int ret = 0;
+
+        /* cached dentries hold references that should not count, and
+         * dropping them may leave vnodes inactive */
+        dcache_purge_fs(fs);
+        vnode_purge_inactive(fs);
+
+        if (NULL == (fl = vnode_fslist(fs, 0)))
+                return 0;
+        list = &fl->vf_vnodes;
+
         for (link = list->l_next; link != list; link = link->l_next) {
                 vnode_t *vn = list_item(link, vnode_t, vn_link);
                 int refs;
 
                 KASSERT(vn->vn_refcount >= vn->vn_nrespages);
                 KASSERT(vn->vn_nrespages >= 0);
-
-                if (fs != vn->vn_fs)
-                        continue;
-
-                /* otherwise, vn belongs to the given fs */
+                KASSERT(fs == vn->vn_fs);
 
                 /* if it is the root vnode and it has more than one
                  * reference
@@ -360,12 +543,19 @@ vfs_is_in_use(fs_t *fs)
 void
 vnode_flush_all(struct fs *fs)
 {
+        vnode_fslist_t *fl;
         vnode_t *v;
         pframe_t *p;
         int err;
 
+        vnode_purge_inactive(fs);
+        if (NULL == (fl = vnode_fslist(fs, 0)))
+                return;
+        /* hold the list: freeing pages can drop the last vnode */
+        fl->vf_count++;
+
 clean:
-        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+        list_iterate_begin(&fl->vf_vnodes, v, vnode_t, vn_link) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
                         if (pframe_is_dirty(p)) {
@@ -385,13 +575,15 @@ clean:
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
          * Now, uncache all of them: */
-        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+        list_iterate_begin(&fl->vf_vnodes, v, vnode_t, vn_link) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
                         KASSERT(!pframe_is_dirty(p));
                         pframe_free(p);
                 } list_iterate_end();
         } list_iterate_end();
+
+        vnode_fslist_put(fl);
 }
 
 
@@ -401,14 +593,9 @@ clean:
 int
 vnode_inuse(struct fs *fs)
 {
-        vnode_t *vn;
-        int n = 0;
+        vnode_fslist_t *fl = vnode_fslist(fs, 0);
 
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
-                if (vn->vn_fs == fs)
-                        n++;
-        } list_iterate_end();
-        return n;
+        return fl ? fl->vf_count : 0;
 }
 
 static void
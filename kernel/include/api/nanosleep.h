@@ -0,0 +1,13 @@
+#pragma once
+
+#include "types.h"
+
+struct timespec {
+        int32_t         tv_sec;
+        int32_t         tv_nsec;
+};
+
+typedef struct nanosleep_args {
+        const struct timespec   *req;
+        struct timespec         *rem;
+} nanosleep_args_t;
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Batched system call submission.
+ *
+ * A process that opts in calls ring_setup(entries) once, which maps a
+ * private read/write region into its address space laid out as a
+ * sysring_hdr_t, followed by 'entries' submission entries, followed by
+ * 'entries' completion entries. The process then fills submission
+ * entries, bumps sq_tail, and calls ring_enter(ring, n) to have the
+ * kernel run up to n of them in order with a single trap. Each one
+ * produces a completion entry at cq_tail.
+ *
+ * The kernel only ever advances sq_head and cq_tail; userland only ever
+ * advances sq_tail and cq_head. All indices are free-running and are
+ * reduced modulo 'entries', which must be a power of two.
+ */
+
+#define SYSRING_MAX_ENTRIES     256
+
+typedef struct sysring_sqe {
+        uint32_t        sqe_sysnum;     /* SYS_* number */
+        uint32_t        sqe_args;       /* same argument word as the trap */
+        uint32_t        sqe_user_data;  /* copied to the completion */
+} sysring_sqe_t;
+
+typedef struct sysring_cqe {
+        uint32_t        cqe_user_data;
+        int32_t         cqe_ret;        /* what the syscall returned */
+        int32_t         cqe_errno;      /* errno if cqe_ret == -1, else 0 */
+} sysring_cqe_t;
+
+typedef struct sysring_hdr {
+        uint32_t        sr_entries;
+        uint32_t        sr_sq_head;
+        uint32_t        sr_sq_tail;
+        uint32_t        sr_cq_head;
+        uint32_t        sr_cq_tail;
+        uint32_t        sr_sq_off;      /* byte offsets from the header */
+        uint32_t        sr_cq_off;
+} sysring_hdr_t;
+
+typedef struct ring_enter_args {
+        sysring_hdr_t   *ring;
+        uint32_t        to_submit;
+} ring_enter_args_t;
+
+#define SYSRING_SIZE(entries) \
+        (sizeof(sysring_hdr_t) + (entries) * (sizeof(sysring_sqe_t) + sizeof(sysring_cqe_t)))
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Per-syscall accounting. syscall_handler() timestamps every call with
+ * the cycle counter and records it both in a global table and in the
+ * calling process's table. Each syscall number gets a call count, an
+ * error count (calls that returned -1) and a log2 histogram of the
+ * latency in cycles: bucket b counts calls that took [2^b, 2^(b+1))
+ * cycles, and the last bucket takes everything longer.
+ *
+ * Entries are allocated the first time a syscall number is seen, so a
+ * process only pays for the syscalls it actually makes.
+ */
+
+#define SYSTAT_NSYSCALL         128
+#define SYSTAT_NBUCKETS         32
+
+typedef struct systat_entry {
+        uint32_t        se_calls;
+        uint32_t        se_errors;
+        uint32_t        se_hist[SYSTAT_NBUCKETS];
+} systat_entry_t;
+
+typedef struct systat {
+        systat_entry_t  *ss_ent[SYSTAT_NSYSCALL];
+} systat_t;
+
+struct proc;
+struct kshell;
+
+void systat_record(struct proc *p, uint32_t sysnum, uint64_t cycles, int failed);
+void systat_reset(systat_t *ss);
+void systat_destroy(systat_t *ss);
+
+/* kshell command: systat [pid] [reset] */
+int systat_kshell(struct kshell *ksh, int argc, char **argv);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * User threads (MTP). thr_create starts a thread in the calling process
+ * running entry(arg) on the given user stack, whose top is stack; the
+ * kernel pushes arg and a null return address, so entry must end with
+ * thr_exit() rather than returning. Threads share the address space and
+ * file table and are named by the id thr_create returns. execve fails
+ * with EBUSY while any other thread of the process has yet to exit.
+ */
+
+typedef struct thr_create_args {
+        void            *entry;
+        void            *arg;
+        void            *stack;
+} thr_create_args_t;
+
+typedef struct thr_join_args {
+        int             tid;
+        void            **retval;       /* may be NULL */
+} thr_join_args_t;
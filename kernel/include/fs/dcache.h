@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Directory entry cache.
+ *
+ * Caches the result of vn_ops->lookup() keyed by (parent vnode, name).
+ * Positive entries hold a reference on the child vnode; negative
+ * entries remember that the name does not exist. Every entry also holds
+ * a reference on its parent so that the key stays valid. "." and ".."
+ * are never cached.
+ *
+ * Anything that adds or removes a name in a directory must call
+ * dcache_invalidate() for that name. A lookup that misses samples
+ * dcache_generation() before calling into the filesystem and passes it
+ * to dcache_enter(), which drops the result if an invalidation raced
+ * with the (possibly blocking) lookup.
+ */
+
+struct vnode;
+struct fs;
+
+/* Names are hashed with 32-bit FNV-1a. The steps are exposed so that the
+ * path walker can hash a component while it scans for its end. */
+#define DCACHE_HASH_INIT        2166136261u
+#define DCACHE_HASH_STEP(h, c)  (((h) ^ (unsigned char)(c)) * 16777619u)
+
+uint32_t dcache_name_hash(const char *name, size_t len);
+
+int      dcache_lookup(struct vnode *dir, const char *name, size_t len,
+                       uint32_t hash, struct vnode **result);
+void     dcache_enter(struct vnode *dir, const char *name, size_t len,
+                      uint32_t hash, struct vnode *vn, uint32_t gen);
+uint32_t dcache_generation(void);
+
+void     dcache_invalidate(struct vnode *dir, const char *name, size_t len);
+void     dcache_purge_fs(struct fs *fs);
+void     dcache_purge_all(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Per-process file descriptor tables.
+ *
+ * A process's descriptors live in p_files, an array of p_nfiles slots
+ * that starts at NFILES and doubles on demand up to FDTABLE_MAX. A
+ * bitmap (p_fdmap) marks the slots in use, and p_fdhint is a lower
+ * bound on the lowest free slot, so allocation skips 32 used slots at
+ * a time and usually finds its answer in the first word it looks at.
+ *
+ * A slot can be marked used while still NULL: get_empty_fd() reserves
+ * the descriptor it returns so that nobody else takes it while the
+ * caller sets up the file. Such a slot must be filled in with
+ * fdtable_install() or given back with fdtable_clear().
+ */
+
+#define FDTABLE_MAX             4096
+
+struct proc;
+struct file;
+
+int  fdtable_init(struct proc *p);
+void fdtable_destroy(struct proc *p);
+
+int  fdtable_alloc(struct proc *p, int minfd);
+int  fdtable_reserve(struct proc *p, int fd);
+void fdtable_install(struct proc *p, int fd, struct file *f);
+void fdtable_clear(struct proc *p, int fd);
+
+int  fdtable_next(struct proc *p, int fd);
+int  fdtable_copy(struct proc *dst, struct proc *src);
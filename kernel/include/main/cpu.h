@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * Processor numbering. NCPU is the most CPUs the kernel will use (set in
+ * Config.mk); cpu_id() is the index of the CPU we are running on.
+ *
+ * The scheduler keeps its run queues per CPU, but nothing starts the
+ * other processors and curthr and curproc are still single globals, so
+ * only one CPU can be used for now.
+ */
+
+#ifdef __NCPU__
+#define NCPU                    __NCPU__
+#else
+#define NCPU                    1
+#endif
+
+#if NCPU > 1
+#error "NCPU > 1 needs AP start-up and per-CPU curthr/curproc, which are not implemented"
+#endif
+
+static inline int
+cpu_id(void)
+{
+        return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * The periodic timer. The local APIC timer fires TIMER_HZ times a
+ * second (set in Config.mk); each tick advances the tick count, the
+ * kinfo time page and, with UPREEMPT, the scheduler's preemption check.
+ */
+
+#ifdef __TIMER_HZ__
+#define TIMER_HZ                __TIMER_HZ__
+#else
+#define TIMER_HZ                100
+#endif
+
+#define TIMER_NS_PER_TICK       (1000000000 / TIMER_HZ)
+
+void timer_init(void);
+
+/* ticks since timer_init() */
+uint32_t timer_ticks(void);
+
+/*
+ * One-shot kernel timers, kept on a hierarchical timing wheel so that
+ * adding, removing and expiring a timer are all O(1) however many are
+ * pending.
+ *
+ * The callback runs from the timer interrupt, so it must not block; it
+ * may make threads runnable and may re-add its own timer.
+ */
+typedef void (*ktimer_func_t)(void *arg);
+
+typedef struct ktimer {
+        list_link_t     tm_link;        /* on a wheel slot while pending */
+        uint32_t        tm_expires;     /* tick at which it fires */
+        ktimer_func_t   tm_func;
+        void            *tm_arg;
+} ktimer_t;
+
+void ktimer_init(ktimer_t *t, ktimer_func_t func, void *arg);
+
+/* Fires t after at least ticks ticks (at least one). t must not be
+ * pending already. */
+void ktimer_add(ktimer_t *t, uint32_t ticks);
+
+/* Cancels t. Returns 1 if it was pending, 0 if it had already fired or
+ * was never added. */
+int  ktimer_del(ktimer_t *t);
+
+int  ktimer_pending(ktimer_t *t);
+
+/* Puts the current thread to sleep for ticks ticks. Returns 0, or
+ * -EINTR if the thread was cancelled, in which case *remain (if not
+ * NULL) is set to the ticks that were left. */
+int  timer_sleep(uint32_t ticks, uint32_t *remain);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "types.h"
+
+/* Reads the CPU's time stamp counter. */
+static inline uint64_t rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "proc/sched.h"
+
+struct kthread;
+
+/*
+ * Reader-writer sleep locks. Any number of readers may hold the lock at
+ * once; a writer holds it alone. Like kmutex_t, ownership is handed
+ * straight to the threads being woken, so a woken thread never has to
+ * re-check the lock.
+ *
+ * A reader arriving while a writer waits queues behind it, so a steady
+ * stream of readers cannot starve writers; a writer releasing the lock
+ * admits every waiting reader before the next writer, so writers cannot
+ * starve readers either.
+ *
+ * Like mutexes, these must only be taken and released from thread
+ * context, and are not re-entrant.
+ */
+typedef struct krwlock {
+        ktqueue_t               krw_rdq;        /* readers waiting */
+        ktqueue_t               krw_wrq;        /* writers waiting */
+        int                     krw_readers;    /* readers holding the lock */
+        struct kthread          *krw_writer;    /* writer holding it, or NULL */
+} krwlock_t;
+
+void krwlock_init(krwlock_t *rw);
+
+void krwlock_rdlock(krwlock_t *rw);
+void krwlock_rdunlock(krwlock_t *rw);
+
+void krwlock_wrlock(krwlock_t *rw);
+void krwlock_wrunlock(krwlock_t *rw);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Lock contention profiling (LOCKPROF in Config.mk).
+ *
+ * With LOCKPROF each kmutex_t carries a kmutex_prof_t, which
+ * kmutex_lock() and kmutex_unlock() feed cycle-counter timestamps.
+ * A mutex is only listed by the `lockstat` kshell command once it has
+ * been named with kmutex_set_name(), which registers it; an owner that
+ * does so must call kmutex_destroy() before freeing the mutex. Most
+ * mutexes are never freed this way, so they stay unregistered rather
+ * than leave dangling pointers on the registry.
+ */
+typedef struct kmutex_prof {
+        const void      *kp_lock;       /* the kmutex_t this belongs to */
+        const char      *kp_name;
+        uint32_t        kp_acquires;
+        uint32_t        kp_contended;   /* acquisitions that had to sleep */
+        uint64_t        kp_wait_total;  /* cycles spent asleep waiting */
+        uint64_t        kp_wait_max;
+        uint64_t        kp_hold_total;  /* cycles held */
+        uint64_t        kp_hold_max;
+        void            *kp_wait_max_ra; /* who waited kp_wait_max */
+        void            *kp_hold_max_ra; /* where the kp_hold_max hold began */
+        uint64_t        kp_acquired;    /* when the current hold began */
+        void            *kp_holder_ra;  /* where the current hold began */
+        list_link_t     kp_link;        /* on the registry */
+} kmutex_prof_t;
+
+struct kshell;
+
+void lockprof_init(kmutex_prof_t *kp, const void *lock);
+/* names kp and adds it to the registry; naming it again just renames it */
+void lockprof_register(kmutex_prof_t *kp, const char *name);
+void lockprof_unregister(kmutex_prof_t *kp);
+
+/* wait is 0 for an uncontended acquisition */
+void lockprof_acquired(kmutex_prof_t *kp, void *ra, int contended, uint64_t wait);
+void lockprof_released(kmutex_prof_t *kp);
+
+/* kshell command: lockstat [count | reset] */
+int lockprof_kshell(struct kshell *ksh, int argc, char **argv);
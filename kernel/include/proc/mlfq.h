@@ -0,0 +1,75 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Multilevel feedback queue scheduling.
+ *
+ * Each CPU has SCHED_NLEVELS run queues; level 0 is the highest
+ * priority and sched_switch() always runs the oldest thread on the
+ * highest non-empty level of its own CPU. A thread at level l has a
+ * quantum of SCHED_QUANTUM_CYCLES << l cycles:
+ *
+ *   o a thread that gives up the CPU while still runnable after using
+ *     its whole quantum drops one level;
+ *   o a thread that blocks before its quantum is used up rises one
+ *     level, so threads waking from I/O get in ahead of CPU hogs;
+ *   o every SCHED_BOOST_CYCLES all threads go back to level 0, so
+ *     nothing on the lower levels starves.
+ *
+ * Quanta are measured with the cycle counter, so demotion works even
+ * without timer preemption: a thread is charged for however long it
+ * ran when it finally yields.
+ */
+
+#define SCHED_NLEVELS           4
+#define SCHED_QUANTUM_CYCLES    1000000ULL
+#define SCHED_BOOST_CYCLES      200000000ULL
+
+/*
+ * Response time is the delay between a thread becoming runnable and it
+ * being switched to. Threads dispatched from the upper half of the
+ * levels are counted as interactive, the rest as batch.
+ */
+#define SCHED_CLASS_INTERACTIVE 0
+#define SCHED_CLASS_BATCH       1
+#define SCHED_NCLASSES          2
+
+#define SCHED_RT_NBUCKETS       32
+
+typedef struct sched_rtstat {
+        uint32_t        rt_count;
+        uint32_t        rt_sum_kc;      /* sum, in units of 1024 cycles */
+        uint32_t        rt_max_kc;
+        uint32_t        rt_hist[SCHED_RT_NBUCKETS];     /* log2 cycles */
+} sched_rtstat_t;
+
+/*
+ * Besides response times, each CPU counts voluntary switches (the
+ * outgoing thread blocked or exited) and involuntary ones (it was still
+ * runnable), how often and for how long it sat idle in intr_wait(), and
+ * a log2 histogram of the run queue length each enqueue found. Each
+ * thread keeps its own switch counts and the total time it has spent
+ * on a run queue (kt_nvcsw, kt_nivcsw, kt_rqwait_kc).
+ */
+#define SCHED_QLEN_NBUCKETS     8
+
+struct kthread;
+struct kshell;
+struct regs;
+
+void sched_thread_init(struct kthread *thr, struct kthread *parent);
+
+/*
+ * User preemption (UPREEMPT). sched_tick() runs on every timer tick and
+ * only flags the running thread once its quantum is used up.
+ * sched_user_return() is the way back to userland from a system call or,
+ * once the handler is done, an interrupt: it acts on the flag through
+ * sched_preempt(), then exits a thread that has been cancelled.
+ */
+void sched_tick(void);
+void sched_preempt(struct regs *regs);
+void sched_user_return(struct regs *regs);
+
+/* kshell command: schedstat [pid | reset] */
+int sched_stat_kshell(struct kshell *ksh, int argc, char **argv);
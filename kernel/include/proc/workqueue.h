@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+#include "main/timer.h"
+
+/*
+ * Deferred work. Instead of each subsystem running its own daemon, work
+ * items are queued here and run, in thread context, by a small pool of
+ * kernel worker threads that is started at boot.
+ *
+ * Each item has one of WORK_NPRIO priorities; workers always take the
+ * oldest item of the highest priority that has any. Queueing an item
+ * that is already pending does nothing, so a subsystem can ask for the
+ * same work many times and have it done once: the work function should
+ * handle everything outstanding when it runs rather than one request.
+ *
+ * An item may be queued again, by anyone including itself, as soon as
+ * its function has started. The work_t must stay allocated until it
+ * is neither pending nor running.
+ */
+
+#define WORK_PRIO_HIGH          0
+#define WORK_PRIO_NORMAL        1
+#define WORK_PRIO_LOW           2
+#define WORK_NPRIO              3
+
+#define WORKQ_NWORKERS          2
+
+typedef void (*work_func_t)(void *arg);
+
+typedef struct work {
+        list_link_t     w_link;         /* on a priority list while pending */
+        work_func_t     w_func;
+        void            *w_arg;
+        int             w_prio;
+        ktimer_t        w_timer;        /* for work_queue_delayed() */
+} work_t;
+
+void work_init(work_t *w, work_func_t func, void *arg);
+
+/* Queues w to run at priority prio. May be called from interrupt
+ * context. Returns 1 if it was queued, 0 if it was already pending. */
+int  work_queue(work_t *w, int prio);
+
+/* As work_queue(), but only after ticks timer ticks. Returns 0 if w is
+ * already pending or waiting on its delay. */
+int  work_queue_delayed(work_t *w, int prio, uint32_t ticks);
+
+/* Takes w off the queue, or stops its delay, if it has not started to
+ * run. Returns 1 if it was pending. Does not wait for a running w. */
+int  work_cancel(work_t *w);
+
+int  work_pending(work_t *w);
+
+/* Runs everything still queued, then stops the workers and reaps them.
+ * Called from idleproc at shutdown. Delayed work that has not come due
+ * is dropped. */
+void workqueue_shutdown(void);
+
+struct kshell;
+
+/* kshell command: workstat */
+int workqueue_kshell(struct kshell *ksh, int argc, char **argv);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Helpers shared by the statistics the kernel keeps and the kshell
+ * commands that report them (systat, schedstat, lockstat). Cycle counts
+ * are 64-bit, and these avoid 64-bit division so that the kernel does
+ * not need libgcc's helpers for it.
+ */
+
+/* The index of the highest set bit in v (0 for 0 and 1), clamped to
+ * nbuckets - 1: the bucket of v in a log2 histogram. */
+static inline int
+stats_log2_bucket(uint64_t v, int nbuckets)
+{
+        uint32_t hi = (uint32_t)(v >> 32);
+        uint32_t w = hi ? hi : (uint32_t)v;
+        int b = hi ? 32 : 0;
+
+        while (w >>= 1) {
+                b++;
+        }
+        return (b < nbuckets) ? b : nbuckets - 1;
+}
+
+/* cycles in units of 1024, clamped to 32 bits, for printing */
+static inline uint32_t
+stats_kcycles(uint64_t cycles)
+{
+        cycles >>= 10;
+        return (cycles > 0xffffffffULL) ? 0xffffffffU : (uint32_t)cycles;
+}
+
+/* Parses s, which must be a non-empty string of decimal digits whose
+ * value fits in 31 bits. Returns 1 and sets *v, or returns 0. */
+static inline int
+stats_parse_uint(const char *s, int *v)
+{
+        int n = 0;
+
+        if ('\0' == *s) {
+                return 0;
+        }
+        for (; *s; s++) {
+                if (*s < '0' || *s > '9' || n > (0x7fffffff - (*s - '0')) / 10) {
+                        return 0;
+                }
+                n = n * 10 + (*s - '0');
+        }
+        *v = n;
+        return 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Futexes: sleeping on a word of user memory.
+ *
+ * FUTEX_WAIT sleeps if the 32-bit word at uaddr still holds val, and
+ * fails with EAGAIN if it does not. The check and the sleep are atomic
+ * with respect to FUTEX_WAKE, which wakes up to val threads waiting on
+ * the same word and returns how many it woke.
+ *
+ * A word in a MAP_SHARED mapping is identified by the memory object
+ * behind the mapping and its offset within that object, not by its
+ * virtual address, so processes sharing the mapping can synchronize
+ * through it even if it is mapped at different addresses. A word in a
+ * MAP_PRIVATE mapping is only visible to its own process and is
+ * identified by the address space and its virtual address.
+ */
+
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
+
+typedef struct futex_args {
+        uint32_t        *uaddr;
+        int             op;
+        uint32_t        val;
+} futex_args_t;
+
+int do_futex(uint32_t *uaddr, int op, uint32_t val);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+#include "mm/mm.h"
+#include "mm/page.h"
+
+/*
+ * Read-only kernel info pages, mapped at a fixed address into every
+ * user address space so that userland can get at a few values without
+ * trapping.
+ *
+ * The first page belongs to the process and is written once when it is
+ * mapped. The second page is the same physical page in every process
+ * and is updated in place by the kernel. Its writer bumps ki_seq to an
+ * odd value before changing anything and back to an even value after,
+ * so a reader retries while ki_seq is odd or changed under it.
+ */
+
+#define KINFO_ADDR              USER_MEM_LOW
+#define KINFO_NPAGES            2
+
+typedef struct kinfo_proc {
+        int32_t         ki_pid;
+} kinfo_proc_t;
+
+typedef struct kinfo_time {
+        volatile uint32_t ki_seq;
+        uint32_t        ki_hz;          /* ticks per second, 0 if no timer */
+        uint64_t        ki_ticks;       /* monotonic tick count since boot */
+        uint64_t        ki_tsc_base;    /* TSC when ki_ticks was 0 */
+        uint32_t        ki_tsc_khz;     /* TSC frequency, 0 until calibrated */
+} kinfo_time_t;
+
+#define KINFO_PROC      ((const kinfo_proc_t *)KINFO_ADDR)
+#define KINFO_TIME      ((const kinfo_time_t *)(KINFO_ADDR + PAGE_SIZE))
+
+struct proc;
+
+void kinfo_init(void);
+int  kinfo_map(struct proc *p);
+
+/* Called by the timer on every tick */
+void kinfo_tick(void);
+void kinfo_calibrate(uint32_t hz, uint32_t tsc_khz);
@@ -16,16 +16,21 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/kinfo.h"
 
 #include "main/acpi.h"
 #include "main/apic.h"
 #include "main/interrupt.h"
 #include "main/cpuid.h"
 #include "main/gdt.h"
+#include "main/timer.h"
 
 #include "proc/sched.h"
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/mlfq.h"
+#include "proc/lockprof.h"
+#include "proc/workqueue.h"
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
@@ -33,6 +38,7 @@
 
 #include "api/exec.h"
 #include "api/syscall.h"
+#include "api/systat.h"
 
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -115,10 +121,12 @@ kmain()
 #ifdef __VM__
     anon_init();
     shadow_init();
+    kinfo_init();
 #endif
     vmmap_init();
     proc_init();
     kthread_init();
+    timer_init();
     
 #ifdef __DRIVERS__
     bytedev_init();
@@ -268,6 +276,9 @@ idleproc_run(int arg1, void *arg2)
     kthread_reapd_shutdown();
 #endif
     
+    /* exited processes' address spaces may still hold vnodes */
+    vmmap_reap_flush();
+    
     
 #ifdef __VFS__
     /* Shutdown the vfs: */
@@ -278,6 +289,11 @@ idleproc_run(int arg1, void *arg2)
     
 #endif
     
+    /* Run whatever work is still queued and stop the workers */
+    workqueue_shutdown();
+    /* ...and free the workers' own address spaces */
+    vmmap_reap_flush();
+    
     /* Shutdown the pframe system */
 #ifdef __S5FS__
     pframe_shutdown();
@@ -400,6 +416,13 @@ initproc_run(int arg1, void *arg2)
             kshell_add_command("vfstest", (kshell_cmd_func_t)vfstest_main_2, "vfstest_main starts...");
             kshell_add_command("vm_test_1", (kshell_cmd_func_t)vmtest_link_unlink, "Test for do_link(),do_unlink(),do_read(),do_write(), do_open(), do_close() starts...");
             kshell_add_command("vm_test_2", (kshell_cmd_func_t)vmtest_map_destory, "Test for vmmap_create(),vmmap_insert(),vmmap_find_range(), vmmap_destory() starts...");
+            
+            kshell_add_command("systat", (kshell_cmd_func_t)systat_kshell, "systat [pid] [reset]: per-syscall counts and latency histograms");
+#ifdef __LOCKPROF__
+            kshell_add_command("lockstat", (kshell_cmd_func_t)lockprof_kshell, "lockstat [count | reset]: kmutexes sorted by total wait");
+#endif
+            kshell_add_command("workstat", (kshell_cmd_func_t)workqueue_kshell, "workstat: kernel workqueue activity");
+            kshell_add_command("schedstat", (kshell_cmd_func_t)sched_stat_kshell, "schedstat [pid | reset]: context switches, idle time, run queue waits and lengths");
 
             
             
@@ -717,6 +740,7 @@ testKillAllWhenRunning() {
     proc_t *process1 = proc_create("p1");
     
     kthread_t *thread1 = kthread_create(process1, (kthread_func_t)increment, count, NULL);
+    KASSERT(thread1 != NULL);
     
     sched_make_runnable(thread1);
     
@@ -724,6 +748,7 @@ testKillAllWhenRunning() {
     proc_t *process2 = proc_create("p1");
     
     kthread_t *thread2 = kthread_create(process2, (kthread_func_t)increment, count,NULL);
+    KASSERT(thread2 != NULL);
     
     sched_make_runnable(thread2);
     
@@ -732,6 +757,7 @@ testKillAllWhenRunning() {
     proc_t *process3 = proc_create("p1");
     
     kthread_t *thread3 = kthread_create(process3, (kthread_func_t)increment, count,NULL);
+    KASSERT(thread3 != NULL);
     
     sched_make_runnable(thread3);
     
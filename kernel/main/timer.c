@@ -0,0 +1,254 @@
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "main/timer.h"
+#include "main/tsc.h"
+
+#include "proc/sched.h"
+#include "proc/mlfq.h"
+
+#include "vm/kinfo.h"
+
+#include "util/list.h"
+#include "util/debug.h"
+
+/*
+ * The timing wheel. The root wheel has one slot per tick for the next
+ * 256 ticks; each outer level has 64 slots, each covering a whole turn
+ * of the level inside it. When the root wheel wraps, the next slot of
+ * level 0 is emptied back into the root, and so on outwards, so a timer
+ * is moved at most TW_NLEVELS times before it fires. Timers further out
+ * than the wheel reaches wait in the outermost level and are re-filed
+ * each time it comes round.
+ */
+#define TW_ROOT_BITS            8
+#define TW_LVL_BITS             6
+#define TW_NLEVELS              3
+#define TW_ROOT_SIZE            (1 << TW_ROOT_BITS)
+#define TW_LVL_SIZE             (1 << TW_LVL_BITS)
+#define TW_ROOT_MASK            (TW_ROOT_SIZE - 1)
+#define TW_LVL_MASK             (TW_LVL_SIZE - 1)
+#define TW_SHIFT(lvl)           (TW_ROOT_BITS + (lvl) * TW_LVL_BITS)
+#define TW_SPAN(lvl)            (1u << TW_SHIFT(lvl))
+
+static list_t tw_root[TW_ROOT_SIZE];
+static list_t tw_lvl[TW_NLEVELS][TW_LVL_SIZE];
+
+static volatile uint32_t timer_nticks = 0;
+
+/* the next tick whose timers have not been run yet */
+static uint32_t tw_clock = 1;
+
+/* cycle counter at the first tick; used to work out the TSC rate once a
+ * second's worth of ticks has gone by */
+static uint64_t timer_tsc_start = 0;
+
+/* Files t in the slot for its expiry time. Called at IPL_HIGH. */
+static void
+tw_insert(ktimer_t *t)
+{
+        uint32_t delta = t->tm_expires - tw_clock;
+        uint32_t exp = t->tm_expires;
+        int lvl;
+
+        if ((int32_t)delta < 0) {
+                /* already due; runs on the next tick processed */
+                list_insert_tail(&tw_root[tw_clock & TW_ROOT_MASK], &t->tm_link);
+                return;
+        }
+        if (delta < TW_ROOT_SIZE) {
+                list_insert_tail(&tw_root[exp & TW_ROOT_MASK], &t->tm_link);
+                return;
+        }
+        for (lvl = 0; lvl < TW_NLEVELS - 1; lvl++) {
+                if (delta < TW_SPAN(lvl + 1)) {
+                        break;
+                }
+        }
+        if (lvl == TW_NLEVELS - 1 && delta >= TW_SPAN(TW_NLEVELS)) {
+                /* beyond the wheel: park it in the farthest slot */
+                exp = tw_clock + TW_SPAN(TW_NLEVELS) - 1;
+        }
+        list_insert_tail(&tw_lvl[lvl][(exp >> TW_SHIFT(lvl)) & TW_LVL_MASK],
+                         &t->tm_link);
+}
+
+/* Empties one outer slot back into the wheel. Returns the slot index
+ * so the caller can tell whether this level has wrapped too. */
+static int
+tw_cascade(int lvl)
+{
+        int idx = (tw_clock >> TW_SHIFT(lvl)) & TW_LVL_MASK;
+        list_t *slot = &tw_lvl[lvl][idx];
+        ktimer_t *t;
+
+        while (!list_empty(slot)) {
+                t = list_head(slot, ktimer_t, tm_link);
+                list_remove(&t->tm_link);
+                tw_insert(t);
+        }
+        return idx;
+}
+
+/* Runs every timer due at tw_clock. Called from the timer interrupt. */
+static void
+tw_run(void)
+{
+        int idx = tw_clock & TW_ROOT_MASK;
+        int lvl;
+        list_t due;
+        ktimer_t *t;
+
+        if (0 == idx) {
+                for (lvl = 0; lvl < TW_NLEVELS; lvl++) {
+                        if (0 != tw_cascade(lvl)) {
+                                break;
+                        }
+                }
+        }
+
+        /* a callback may re-add its timer, so take the slot's contents
+         * first and run from the copy */
+        list_init(&due);
+        while (!list_empty(&tw_root[idx])) {
+                t = list_head(&tw_root[idx], ktimer_t, tm_link);
+                list_remove(&t->tm_link);
+                list_insert_tail(&due, &t->tm_link);
+        }
+        while (!list_empty(&due)) {
+                t = list_head(&due, ktimer_t, tm_link);
+                list_remove(&t->tm_link);
+                t->tm_func(t->tm_arg);
+        }
+}
+
+static void
+timer_handler(regs_t *regs)
+{
+        timer_nticks++;
+
+#ifdef __VM__
+        if (1 == timer_nticks) {
+                timer_tsc_start = rdtsc();
+        } else if (1 + TIMER_HZ == timer_nticks) {
+                /* (delta >> 3) / 125 == delta / 1000 without a 64-bit divide */
+                uint32_t khz = (uint32_t)((rdtsc() - timer_tsc_start) >> 3) / 125;
+                kinfo_calibrate(TIMER_HZ, khz);
+                dbg(DBG_CORE, "timer: TSC runs at %u kHz\n", khz);
+        }
+        kinfo_tick();
+#endif
+
+        while ((int32_t)(timer_nticks - tw_clock) >= 0) {
+                tw_run();
+                tw_clock++;
+        }
+
+#ifdef __UPREEMPT__
+        /* only mark the thread: the switch is made by
+         * sched_user_return() on the way out of the interrupt, after the
+         * EOI, so a thread spinning in userland still gets preempted */
+        sched_tick();
+#endif
+}
+
+/*
+ * Called from kmain once interrupts can be registered.
+ */
+void
+timer_init(void)
+{
+        int i, j;
+
+        for (i = 0; i < TW_ROOT_SIZE; i++) {
+                list_init(&tw_root[i]);
+        }
+        for (i = 0; i < TW_NLEVELS; i++) {
+                for (j = 0; j < TW_LVL_SIZE; j++) {
+                        list_init(&tw_lvl[i][j]);
+                }
+        }
+
+        intr_register(INTR_APICTIMER, timer_handler);
+        apic_enable_periodic_timer(TIMER_HZ);
+        dbg(DBG_CORE, "timer: %d Hz\n", TIMER_HZ);
+}
+
+uint32_t
+timer_ticks(void)
+{
+        return timer_nticks;
+}
+
+void
+ktimer_init(ktimer_t *t, ktimer_func_t func, void *arg)
+{
+        list_link_init(&t->tm_link);
+        t->tm_expires = 0;
+        t->tm_func = func;
+        t->tm_arg = arg;
+}
+
+void
+ktimer_add(ktimer_t *t, uint32_t ticks)
+{
+        uint8_t oldipl = intr_getipl();
+
+        KASSERT(!list_link_is_linked(&t->tm_link));
+        /* expiry times are compared as signed differences */
+        if (ticks > 0x7fffffff) {
+                ticks = 0x7fffffff;
+        }
+        intr_setipl(IPL_HIGH);
+        t->tm_expires = timer_nticks + (ticks ? ticks : 1);
+        tw_insert(t);
+        intr_setipl(oldipl);
+}
+
+int
+ktimer_del(ktimer_t *t)
+{
+        uint8_t oldipl = intr_getipl();
+        int pending;
+
+        intr_setipl(IPL_HIGH);
+        if ((pending = list_link_is_linked(&t->tm_link))) {
+                list_remove(&t->tm_link);
+        }
+        intr_setipl(oldipl);
+        return pending;
+}
+
+int
+ktimer_pending(ktimer_t *t)
+{
+        return list_link_is_linked(&t->tm_link);
+}
+
+int
+timer_sleep(uint32_t ticks, uint32_t *remain)
+{
+        uint32_t deadline = timer_nticks + ticks;
+        ktqueue_t q;
+        int ret;
+
+        if (0 == ticks) {
+                return 0;
+        }
+        /* nobody else knows about q, so only the timer or a cancel can
+         * end the sleep */
+        sched_queue_init(&q);
+        ret = sched_sleep_on_timeout(&q, ticks);
+        if (-EINTR == ret) {
+                if (NULL != remain) {
+                        *remain = ((int32_t)(deadline - timer_nticks) > 0)
+                                  ? deadline - timer_nticks : 0;
+                }
+                return -EINTR;
+        }
+        return 0;
+}
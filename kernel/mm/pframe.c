@@ -3,6 +3,8 @@
 #include "errno.h"
 
 #include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/workqueue.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -17,6 +19,8 @@
 
 #include "vm/vmmap.h"
 
+#include "fs/vnode.h"
+
 /*
  * In this file, physical pages (as represented by pframes) will be
  * referred to as "pages"
@@ -96,18 +100,14 @@ static list_t pframe_hash[PF_HASH_SIZE];
 static uint32_t nfreepages_min = 0;
 static uint32_t nfreepages_target = 0;
 
-/*   pageoutd sleeps on this queue */
-static proc_t *pageoutd = NULL;
-static kthread_t *pageoutd_thr = NULL;
-static ktqueue_t pageoutd_waitq;
+/*   pageout runs as a work item on the kernel workqueue */
+static work_t pageout_work;
 
-/* threads waiting for pageoutd to run sleep on this queue */
+/* threads waiting for pageout to run sleep on this queue */
 static ktqueue_t alloc_waitq;
 
-/* Pageout daemon functions */
-static void *pageoutd_run(int arg1, void *arg2);
-static void pageoutd_exit(void);
-#define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
+static void pageout_run(void *arg);
+#define pageoutd_wakeup()        (work_queue(&pageout_work, WORK_PRIO_HIGH))
 #define pageoutd_needed()        \
 	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
@@ -142,6 +142,8 @@ pframe_init(void)
 
 		/* initialize alloc_waitq */
 		sched_queue_init(&alloc_waitq);
+
+        work_init(&pageout_work, pageout_run, NULL);
 }
 
 void
@@ -149,12 +151,8 @@ pframe_shutdown()
 {
         KASSERT(PID_IDLE == curproc->p_pid); /* Should call from idleproc */
 
-        /* Stop pageoutd and wait for it */
-        pageoutd_exit();
-
-        int pid = pageoutd->p_pid;
-        int child = do_waitpid(-1, 0, NULL);
-        KASSERT(pid == child && "waited on process other than pageoutd");
+        /* workqueue_shutdown() has already run any pending pageout */
+        KASSERT(!work_pending(&pageout_work));
         KASSERT(0 == npinned && "WARNING: FOUND PINNED "
                 "PAGES!!!!!!!!!! SOMETHING IS BROKEN!!\n");
 
@@ -584,6 +582,69 @@ pframe_free(pframe_t *pf)
         o->mmo_ops->put(o);
 }
 
+#define PFRAME_FREE_BATCH       32
+
+/*
+ * Frees the resident pages of an object that nothing refers to any more
+ * except those pages (mmo_refcount == mmo_nrespages), as anon and shadow
+ * objects are at the end of their last put(). No vmarea reaches such an
+ * object, and whoever dropped a vmarea's reference unmapped its range and
+ * flushed the TLB before the put(): vmmap_remove() and vmmap_destroy() do
+ * so for the current process, and vmmap_destroy_deferred() for an exiting
+ * one. So unlike pframe_free() this skips the per-page TLB flush and page
+ * table walk. It also drops each page's reference on o directly instead
+ * of through put(), which would otherwise run once per page. Pinned pages are unpinned first. The frames go back to the page
+ * allocator PFRAME_FREE_BATCH at a time, and anyone waiting for memory
+ * is woken once per batch.
+ *
+ * A busy page, one that pageout is cleaning, is left resident but
+ * unpinned: once pageout frees it, its put() finishes the object off.
+ * The caller may free o if it has no resident pages left. Does not
+ * block.
+ */
+void
+pframe_free_obj(mmobj_t *o)
+{
+        void *batch[PFRAME_FREE_BATCH];
+        pframe_t *pf;
+        int n = 0, i;
+
+        KASSERT(o->mmo_refcount == o->mmo_nrespages);
+
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                while (pframe_is_pinned(pf)) {
+                        pframe_unpin(pf);
+                }
+                if (pframe_is_busy(pf)) {
+                        continue;
+                }
+                list_remove(&pf->pf_hlink);
+                list_remove(&pf->pf_link);
+                nallocated--;
+                list_remove(&pf->pf_olink);
+                o->mmo_nrespages--;
+                o->mmo_refcount--;
+                pf->pf_obj = NULL;
+
+                batch[n++] = pf->pf_addr;
+                slab_obj_free(pframe_allocator, pf);
+                if (PFRAME_FREE_BATCH == n) {
+                        for (i = 0; i < n; i++) {
+                                page_free(batch[i]);
+                        }
+                        n = 0;
+                        sched_broadcast_on(&alloc_waitq);
+                }
+        } list_iterate_end();
+
+        for (i = 0; i < n; i++) {
+                page_free(batch[i]);
+        }
+        if (n > 0) {
+                sched_broadcast_on(&alloc_waitq);
+        }
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
@@ -644,89 +705,52 @@ pframe_remove_from_pts(pframe_t *pf)
 }
 
 /* ------------------------------------------------------------------ */
-/* ------------------------- PAGEOUT DAEMON ------------------------- */
+/* -------------------------- PAGEOUT WORK -------------------------- */
 /* ------------------------------------------------------------------ */
 
 /*
- * Initialize the pageout daemon process. This function is called
- * by pframe_init and simply starts up a new thread with the
- * appropriate function as its first call.
- */
-static __attribute__((unused)) void
-pageoutd_init(void)
-{
-        /* initialize pageoutd_waitq: */
-        sched_queue_init(&pageoutd_waitq);
-
-        /* create and schedule pageoutd: */
-        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
-                && "should be calling this from idleproc");
-        pageoutd = proc_create("pageoutd");
-        KASSERT(NULL != pageoutd);
-        pageoutd_thr = kthread_create(pageoutd, pageoutd_run, 0, NULL);
-        KASSERT(NULL != pageoutd_thr);
-
-        sched_make_runnable(pageoutd_thr);
-}
-init_func(pageoutd_init);
-init_depends(sched_init);
-
-/*
- * Just cancel pageoutd
+ * The pageout work item, queued by pframe_get() when free pages run
+ * low, gets the least-recently-requested page from the list of pages
+ * which are available to be paged out until the free page target is
+ * met. Busy pages are waited for and dirty ones cleaned before they are
+ * yanked. Any number of requests made while it is pending are handled
+ * by a single run.
  */
 static void
-pageoutd_exit()
+pageout_run(void *arg)
 {
-        KASSERT(NULL != pageoutd_thr);
-        kthread_cancel(pageoutd_thr, (void *) 0);
-        pageoutd_thr = NULL;
-}
+        KASSERT(nallocated >= 0);
+        dbg(DBG_PFRAME, "PAGEOUT: "
+            "nfreepages_target=|%d| "
+            "nfreepages_min=|%d| "
+            "page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+#ifdef __VFS__
+        /* unreferenced vnodes go first: freeing them releases
+         * whatever the fs has pinned for them */
+        if (!pageoutd_target_met())
+                vnode_reclaim_inactive(-1);
+#endif
+        /* so do the stacks of dead threads kept for reuse */
+        if (!pageoutd_target_met())
+                kthread_cache_trim();
+        while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+                pframe_t *pf;
+
+                /* obtain least-recently-requested page: */
+                pf = list_head(&alloc_list, pframe_t, pf_link);
 
-/*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
- * Both arguments unused.
- */
-static void *
-pageoutd_run(int arg1, void *arg2)
-{
-        while (1) {
-                KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
-                        pframe_t *pf;
-
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
-
-                        if (pframe_is_busy(pf)) {
-                                sched_sleep_on(&pf->pf_waitq);
-                        } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
-                        } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
-                                pframe_free(pf);
-                        }
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                } else if (pframe_is_dirty(pf)) {
+                        pframe_clean(pf);
+                } else {
+                        /* it's not busy, it's clean, and it's
+                         * least-recently-requested; reclaim it: */
+                        pframe_free(pf);
                 }
-
-                /*   release the thundering herd... */
-                sched_broadcast_on(&alloc_waitq);
-
-                dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
-                dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
-					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
-                if (sched_cancellable_sleep_on(&pageoutd_waitq))
-                        kthread_exit((void *)0);
-                dbg(DBG_PFRAME, "PAGEOUT DEMAON: Waking up\n");
-                dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
-					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
         }
-        return NULL;
+
+        /*   release the thundering herd... */
+        sched_broadcast_on(&alloc_waitq);
+        dbg(DBG_PFRAME, "PAGEOUT: done, page_free_count=|%d|\n", page_free_count());
 }
@@ -17,12 +17,15 @@
 #include "mm/tlb.h"
 
 #include "fs/file.h"
+#include "fs/fdtable.h"
 #include "fs/vnode.h"
 
 #include "vm/shadow.h"
 #include "vm/vmmap.h"
+#include "vm/kinfo.h"
 
 #include "api/exec.h"
+#include "api/access.h"
 
 #include "main/interrupt.h"
 
@@ -191,6 +194,10 @@ do_fork(struct regs *regs)
     /* If we create process at the beginning, and any error happened above, we need to do some cleanup. But create a process here can escape that */
     
     new_proc = proc_create(new_proc_name);
+    if (new_proc == NULL) {
+        vmmap_destroy(new_map);
+        return -ENOMEM;
+    }
     
     KASSERT(new_proc->p_state == PROC_RUNNING);
     dbg(DBG_PRINT, "(GRADING3A 7.a) newproc->p_state == PROC_RUNNING \n");
@@ -203,7 +210,16 @@ do_fork(struct regs *regs)
     new_proc->p_vmmap = new_map;
     new_map->vmm_proc = new_proc;
     
+    /* the clone shares the parent's kinfo page; give the child its own */
+    if (kinfo_map(new_proc) < 0) {
+        dbg(DBG_PRINT, "kinfo_map failed for pid %d\n", new_proc->p_pid);
+    }
+    
     kthread_t *new_thr = kthread_clone(curthr);
+    if (new_thr == NULL) {
+        proc_destroy(new_proc);
+        return -ENOMEM;
+    }
     
     KASSERT(new_thr->kt_kstack != NULL);
     dbg(DBG_PRINT, "(GRADING3A 7.a) newthr->kt_kstack != NULL \n");
@@ -229,12 +245,12 @@ do_fork(struct regs *regs)
      6) Copy the file table of the parent into the child. Remember to use fref()
      here.
      */
-    int i = 0;
-    for (i = 0; i < NFILES ; i++){
-        if (curproc->p_files[i] != NULL) {
-            new_proc->p_files[i] = curproc->p_files[i];
-            fref(new_proc->p_files[i]);
-        }
+    /* only the parent's used slots are visited */
+    int ret = fdtable_copy(new_proc, curproc);
+    if (ret < 0) {
+        /* the child has not run, so it can simply be taken apart */
+        proc_destroy(new_proc);
+        return ret;
     }
     
     sched_make_runnable(new_thr);
@@ -246,3 +262,54 @@ do_fork(struct regs *regs)
     
     return new_proc->p_pid;
 }
+
+#ifdef __MTP__
+/*
+ * Starts a new thread in the current process. It shares everything the
+ * process owns and enters userland with the caller's registers, except
+ * that it begins at entry with its stack pointer just below stack, where
+ * arg and a null return address are pushed for it.
+ *
+ * @param regs the caller's registers
+ * @return the new thread's id, or -errno
+ */
+int
+do_thr_create(struct regs *regs, void *entry, void *arg, void *stack)
+{
+    uint32_t frame[2];
+    regs_t new_regs;
+    context_t new_ctx;
+    kthread_t *new_thr;
+    int err;
+    
+    frame[0] = 0;
+    frame[1] = (uint32_t)arg;
+    if ((err = copy_to_user((char *)stack - sizeof(frame), frame, sizeof(frame))) < 0) {
+        return err;
+    }
+    
+    if ((new_thr = kthread_clone(curthr)) == NULL) {
+        return -ENOMEM;
+    }
+    new_thr->kt_proc = curproc;
+    new_thr->kt_retval = NULL;
+    new_thr->kt_errno = 0;
+    new_thr->kt_cancelled = 0;
+    list_insert_tail(&(curproc->p_threads), &(new_thr->kt_plink));
+    
+    new_regs = *regs;
+    new_regs.r_eip = (uint32_t)entry;
+    new_regs.r_useresp = (uint32_t)stack - sizeof(frame);
+    new_regs.r_eax = 0;
+    
+    new_ctx.c_pdptr = curproc->p_pagedir;
+    new_ctx.c_eip = (uint32_t)&userland_entry;
+    new_ctx.c_esp = fork_setup_stack(&new_regs, new_thr->kt_kstack);
+    new_ctx.c_kstack = (uintptr_t)new_thr->kt_kstack;
+    new_ctx.c_kstacksz = curthr->kt_ctx.c_kstacksz;
+    new_thr->kt_ctx = new_ctx;
+    
+    sched_make_runnable(new_thr);
+    return new_thr->kt_tid;
+}
+#endif
@@ -0,0 +1,107 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+
+#include "proc/kthread.h"
+#include "proc/krwlock.h"
+
+/*
+ * IMPORTANT: As with mutexes, reader-writer locks can _NEVER_ be
+ * locked or unlocked from an interrupt context.
+ */
+
+/*
+ * Initializes the fields of the specified krwlock_t.
+ *
+ * @param rw the lock to initialize
+ */
+void
+krwlock_init(krwlock_t *rw)
+{
+    sched_queue_init(&(rw->krw_rdq));
+    sched_queue_init(&(rw->krw_wrq));
+    rw->krw_readers = 0;
+    rw->krw_writer = NULL;
+}
+
+/*
+ * Takes the lock shared. Blocks while a writer holds the lock or is
+ * waiting for it.
+ *
+ * Note: This function may block.
+ *
+ * @param rw the lock to take
+ */
+void
+krwlock_rdlock(krwlock_t *rw)
+{
+    KASSERT(curthr && (curthr != rw->krw_writer));
+    
+    if (rw->krw_writer == NULL && sched_queue_empty(&(rw->krw_wrq))) {
+        rw->krw_readers++;
+    } else {
+        /* whoever wakes us has already counted us as a reader */
+        sched_sleep_on(&(rw->krw_rdq));
+    }
+}
+
+/*
+ * Drops a shared hold. The last reader out hands the lock to the first
+ * waiting writer, if there is one.
+ *
+ * @param rw the lock to release
+ */
+void
+krwlock_rdunlock(krwlock_t *rw)
+{
+    KASSERT(rw->krw_readers > 0 && rw->krw_writer == NULL);
+    
+    if (--rw->krw_readers == 0 && !sched_queue_empty(&(rw->krw_wrq))) {
+        rw->krw_writer = sched_wakeup_on(&(rw->krw_wrq));
+    }
+}
+
+/*
+ * Takes the lock exclusive. Blocks while anyone else holds it.
+ *
+ * Note: This function may block.
+ *
+ * @param rw the lock to take
+ */
+void
+krwlock_wrlock(krwlock_t *rw)
+{
+    KASSERT(curthr && (curthr != rw->krw_writer));
+    
+    if (rw->krw_writer == NULL && rw->krw_readers == 0) {
+        rw->krw_writer = curthr;
+    } else {
+        /* whoever wakes us has already made us the writer */
+        sched_sleep_on(&(rw->krw_wrq));
+    }
+    
+    KASSERT(curthr == rw->krw_writer);
+}
+
+/*
+ * Drops an exclusive hold. Waiting readers are all let in together;
+ * only if there are none does the lock pass to the next writer.
+ *
+ * @param rw the lock to release
+ */
+void
+krwlock_wrunlock(krwlock_t *rw)
+{
+    KASSERT(curthr && (curthr == rw->krw_writer));
+    
+    rw->krw_writer = NULL;
+    if (!sched_queue_empty(&(rw->krw_rdq))) {
+        while (!sched_queue_empty(&(rw->krw_rdq))) {
+            rw->krw_readers++;
+            sched_wakeup_on(&(rw->krw_rdq));
+        }
+    } else if (!sched_queue_empty(&(rw->krw_wrq))) {
+        rw->krw_writer = sched_wakeup_on(&(rw->krw_wrq));
+    }
+}
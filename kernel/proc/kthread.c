@@ -11,21 +11,57 @@
 #include "proc/kthread.h"
 #include "proc/proc.h"
 #include "proc/sched.h"
+#include "proc/mlfq.h"
 
 #include "mm/slab.h"
 #include "mm/page.h"
 
+#ifdef __MTP__
+#include "proc/workqueue.h"
+#endif
+
 kthread_t *curthr; /* global */
 static slab_allocator_t *kthread_allocator = NULL;
 
+/*
+ * Dead threads are kept, kernel stack attached, on kthread_cache so that
+ * fork and exit do not have to go back to the page allocator for a
+ * multi-page contiguous stack every time. Cached threads are linked
+ * through kt_qlink, which a dead thread no longer uses. Pageout empties
+ * the cache with kthread_cache_trim() when memory runs low.
+ */
+#define KTHREAD_CACHE_MAX       16
+
+static list_t kthread_cache;
+static int kthread_ncached = 0;
+
+/*
+ * With KSTACK_GUARD, every kernel stack has a page below it filled with
+ * KSTACK_GUARD_MAGIC, which is checked whenever the stack is freed or
+ * cached. We have no way to leave a hole in the kernel's mappings, so a
+ * stack that runs into it is caught late rather than at the faulting
+ * write, but it is never handed to another thread.
+ */
+#ifdef __KSTACK_GUARD__
+#define KSTACK_GUARD_PAGES      1
+#define KSTACK_GUARD_MAGIC      0x5dacc0deU
+#else
+#define KSTACK_GUARD_PAGES      0
+#endif
+
+/* extra page for "magic" data, plus the guard page if any */
+#define KSTACK_NPAGES   (KSTACK_GUARD_PAGES + 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT))
+
 #ifdef __MTP__
-/* Stuff for the reaper daemon, which cleans up dead detached threads */
-static proc_t *reapd = NULL;
-static kthread_t *reapd_thr = NULL;
-static ktqueue_t reapd_waitq;
+/* Stuff for the reaper, which cleans up dead detached threads. It runs
+ * as a work item, since a thread cannot free the stack it is on. */
+static work_t kthread_reapd_work;
 static list_t kthread_reapd_deadlist; /* Threads to be cleaned */
 
-static void *kthread_reapd_run(int arg1, void *arg2);
+static void kthread_reapd_run(void *arg);
+
+/* thread ids are unique for the life of the system */
+static int kthread_next_tid = 0;
 #endif
 
 void
@@ -33,6 +69,11 @@ kthread_init()
 {
         kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
         KASSERT(NULL != kthread_allocator);
+        list_init(&kthread_cache);
+#ifdef __MTP__
+        list_init(&kthread_reapd_deadlist);
+        work_init(&kthread_reapd_work, kthread_reapd_run, NULL);
+#endif
 }
 
 /**
@@ -44,12 +85,41 @@ kthread_init()
 static char *
 alloc_stack(void)
 {
-        /* extra page for "magic" data */
         char *kstack;
-        int npages = 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT);
-        kstack = (char *)page_alloc_n(npages);
+        kstack = (char *)page_alloc_n(KSTACK_NPAGES);
+        if (NULL == kstack) {
+                return NULL;
+        }
 
-        return kstack;
+#ifdef __KSTACK_GUARD__
+        uint32_t *guard = (uint32_t *)kstack;
+        unsigned int i;
+        for (i = 0; i < KSTACK_GUARD_PAGES * PAGE_SIZE / sizeof(uint32_t); i++) {
+                guard[i] = KSTACK_GUARD_MAGIC;
+        }
+#endif
+        return kstack + KSTACK_GUARD_PAGES * PAGE_SIZE;
+}
+
+/**
+ * Panics if the stack has overflowed into its guard page. Does nothing
+ * without KSTACK_GUARD.
+ *
+ * @param stack the stack to check
+ */
+static void
+check_stack(char *stack)
+{
+#ifdef __KSTACK_GUARD__
+        uint32_t *guard = (uint32_t *)(stack - KSTACK_GUARD_PAGES * PAGE_SIZE);
+        unsigned int i;
+        for (i = 0; i < KSTACK_GUARD_PAGES * PAGE_SIZE / sizeof(uint32_t); i++) {
+                if (KSTACK_GUARD_MAGIC != guard[i]) {
+                        panic("kernel stack at %p overflowed into its guard page\n",
+                              stack);
+                }
+        }
+#endif
 }
 
 /**
@@ -60,7 +130,36 @@ alloc_stack(void)
 static void
 free_stack(char *stack)
 {
-        page_free_n(stack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
+        check_stack(stack);
+        page_free_n(stack - KSTACK_GUARD_PAGES * PAGE_SIZE, KSTACK_NPAGES);
+}
+
+/**
+ * Gets a kthread_t with a kernel stack, from the cache if possible.
+ * Every other field is left for the caller to set.
+ *
+ * @return the thread, or NULL if there is not enough memory available
+ */
+static kthread_t *
+kthread_alloc(void)
+{
+        kthread_t *thr;
+
+        if (!list_empty(&kthread_cache)) {
+                thr = list_head(&kthread_cache, kthread_t, kt_qlink);
+                list_remove(&thr->kt_qlink);
+                kthread_ncached--;
+                return thr;
+        }
+
+        if (NULL == (thr = (kthread_t *)slab_obj_alloc(kthread_allocator))) {
+                return NULL;
+        }
+        if (NULL == (thr->kt_kstack = alloc_stack())) {
+                slab_obj_free(kthread_allocator, thr);
+                return NULL;
+        }
+        return thr;
 }
 
 /*
@@ -90,15 +189,18 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
     KASSERT(NULL != p);
     dbg(DBG_PRINT, "(GRADING1 3.a) This thread has associated process\n");
     
-    kthread_t *newThr = (kthread_t *)slab_obj_alloc(kthread_allocator);
+    kthread_t *newThr = kthread_alloc();
+    if (newThr == NULL) {
+        return NULL;
+    }
     
-    newThr->kt_kstack = alloc_stack();
     newThr->kt_retval = NULL;
     newThr->kt_errno = 0;
     newThr->kt_proc = p;
     newThr->kt_cancelled = 0;
     newThr->kt_wchan = NULL;
     newThr->kt_state = KT_NO_STATE;
+    sched_thread_init(newThr, NULL);
     /* first, initial list link*/
     list_link_init(&(newThr->kt_qlink));
     
@@ -106,9 +208,11 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
     /* add this thread to its process*/
     list_insert_tail(&(p->p_threads), &(newThr->kt_plink));
     
-    /* we don't need to init _MTP_ part because in weenix, there is only one thread in each process.
-      even we hope to support MTP, we can add it letter.
-     */
+#ifdef __MTP__
+    newThr->kt_tid = kthread_next_tid++;
+    newThr->kt_detached = 0;
+    sched_queue_init(&(newThr->kt_joinq));
+#endif
     
     /* Initialize the thread context*/
     context_setup(&(newThr->kt_ctx), func, (int) arg1, arg2, newThr->kt_kstack, DEFAULT_STACK_SIZE, p->p_pagedir);
@@ -120,13 +224,43 @@ void
 kthread_destroy(kthread_t *t)
 {
         KASSERT(t && t->kt_kstack);
-        free_stack(t->kt_kstack);
+        KASSERT(!list_link_is_linked(&t->kt_qlink));
         if (list_link_is_linked(&t->kt_plink))
                 list_remove(&t->kt_plink);
 
+        if (kthread_ncached < KTHREAD_CACHE_MAX) {
+                check_stack(t->kt_kstack);
+                list_insert_head(&kthread_cache, &t->kt_qlink);
+                kthread_ncached++;
+                return;
+        }
+        free_stack(t->kt_kstack);
         slab_obj_free(kthread_allocator, t);
 }
 
+/*
+ * Frees every cached thread and its stack. Called by pageout when free
+ * memory runs low.
+ *
+ * @return the number of threads freed
+ */
+int
+kthread_cache_trim(void)
+{
+        kthread_t *t;
+        int n = 0;
+
+        while (!list_empty(&kthread_cache)) {
+                t = list_head(&kthread_cache, kthread_t, kt_qlink);
+                list_remove(&t->kt_qlink);
+                kthread_ncached--;
+                free_stack(t->kt_kstack);
+                slab_obj_free(kthread_allocator, t);
+                n++;
+        }
+        return n;
+}
+
 /*
  * If the thread to be cancelled is the current thread, this is
  * equivalent to calling kthread_exit. Otherwise, the thread is
@@ -196,6 +330,9 @@ kthread_exit(void *retval)
     
     curthr->kt_retval = retval;
     curthr->kt_state = KT_EXITED;
+#ifdef __MTP__
+    sched_broadcast_on(&(curthr->kt_joinq));
+#endif
     proc_thread_exited(retval);
 }
 
@@ -215,17 +352,26 @@ kthread_clone(kthread_t *thr)
     dbg(DBG_PRINT, "(GRADING3A 8.a) KT_RUN == thr->kt_state \n");
 
     /* Same code from kthread_create copied here.*/
-    kthread_t *newThr = (kthread_t *)slab_obj_alloc(kthread_allocator);
-    newThr->kt_kstack = alloc_stack();
+    kthread_t *newThr = kthread_alloc();
+    if (newThr == NULL) {
+        return NULL;
+    }
     newThr->kt_retval = thr->kt_retval;
     newThr->kt_errno = thr->kt_errno;
     newThr->kt_proc = NULL; /* After implementing fork, it seems that this cannot be set yet. Needs to be set in fork.*/
     newThr->kt_cancelled = thr->kt_cancelled;
     newThr->kt_wchan = NULL;
     newThr->kt_state = thr->kt_state;
+    sched_thread_init(newThr, thr);
     /* first, initial list link*/
     list_link_init(&(newThr->kt_qlink));
     list_link_init(&(newThr->kt_plink));
+#ifdef __MTP__
+    /* the clone is a new thread; it is not joined with its original */
+    newThr->kt_tid = kthread_next_tid++;
+    newThr->kt_detached = 0;
+    sched_queue_init(&(newThr->kt_joinq));
+#endif
     
     /* Initialize the thread context*/
     
@@ -244,41 +390,109 @@ kthread_clone(kthread_t *thr)
  * unless your weenix is perfect.
  */
 #ifdef __MTP__
+/*
+ * Makes kthr, a thread of the current process, free itself when it
+ * exits instead of waiting to be joined. If it has already exited it
+ * is freed now.
+ *
+ * @return 0, or -EINVAL if kthr is already detached or being joined
+ */
 int
 kthread_detach(kthread_t *kthr)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_detach");
+        KASSERT(NULL != kthr && kthr->kt_proc == curproc);
+
+        if (kthr->kt_detached || !sched_queue_empty(&kthr->kt_joinq)) {
+                return -EINVAL;
+        }
+        if (KT_EXITED == kthr->kt_state) {
+                kthread_destroy(kthr);
+        } else {
+                kthr->kt_detached = 1;
+        }
         return 0;
 }
 
+/*
+ * Waits for kthr, a thread of the current process, to exit, then frees
+ * it. Only one thread may join a given thread.
+ *
+ * @param retval if not NULL, where to store kthr's return value
+ * @return 0, -EINVAL if kthr is the caller, detached or already being
+ * joined, or -EINTR if the caller was cancelled while waiting
+ */
 int
 kthread_join(kthread_t *kthr, void **retval)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_join");
+        int err;
+
+        KASSERT(NULL != kthr && kthr->kt_proc == curproc);
+
+        if (kthr == curthr || kthr->kt_detached
+            || !sched_queue_empty(&kthr->kt_joinq)) {
+                return -EINVAL;
+        }
+        while (KT_EXITED != kthr->kt_state) {
+                if ((err = sched_cancellable_sleep_on(&kthr->kt_joinq)) < 0) {
+                        return err;
+                }
+        }
+        if (NULL != retval) {
+                *retval = kthr->kt_retval;
+        }
+        kthread_destroy(kthr);
         return 0;
 }
 
+/* Returns the thread of p with the given id, or NULL. */
+kthread_t *
+kthread_lookup(struct proc *p, int tid)
+{
+        kthread_t *kthr;
+        list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+                if (kthr->kt_tid == tid) {
+                        return kthr;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
 /* ------------------------------------------------------------------ */
 /* -------------------------- REAPER DAEMON ------------------------- */
 /* ------------------------------------------------------------------ */
-static __attribute__((unused)) void
-kthread_reapd_init()
+
+/*
+ * Hands t, a detached thread that has just exited, to the reaper. t is
+ * taken out of its process at once so that nothing else can find it;
+ * it is freed once it has switched away for the last time.
+ */
+void
+kthread_reap(kthread_t *t)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_init");
+        KASSERT(t->kt_detached && KT_EXITED == t->kt_state);
+        KASSERT(!list_link_is_linked(&t->kt_qlink));
+
+        list_remove(&t->kt_plink);
+        list_insert_tail(&kthread_reapd_deadlist, &t->kt_qlink);
+        work_queue(&kthread_reapd_work, WORK_PRIO_LOW);
 }
-init_func(kthread_reapd_init);
-init_depends(sched_init);
 
 void
 kthread_reapd_shutdown()
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_shutdown");
+        work_cancel(&kthread_reapd_work);
+        kthread_reapd_run(NULL);
 }
 
-static void *
-kthread_reapd_run(int arg1, void *arg2)
+static void
+kthread_reapd_run(void *arg)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_run");
-        return (void *) 0;
+        kthread_t *t;
+
+        while (!list_empty(&kthread_reapd_deadlist)) {
+                t = list_head(&kthread_reapd_deadlist, kthread_t, kt_qlink);
+                list_remove(&t->kt_qlink);
+                kthread_destroy(t);
+        }
 }
 #endif
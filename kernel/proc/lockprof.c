@@ -0,0 +1,144 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "main/tsc.h"
+
+#include "util/list.h"
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/stats.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/lockprof.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+#define LOCKPROF_DEFAULT_COUNT  20
+
+/* Mutexes are initialized from init functions and even earlier, so
+ * the registry sets itself up on first use rather than in an init_func. */
+static list_t lockprof_registry;
+static int lockprof_count = 0;
+
+void
+lockprof_init(kmutex_prof_t *kp, const void *lock)
+{
+        memset(kp, 0, sizeof(*kp));
+        kp->kp_lock = lock;
+        kp->kp_name = "kmutex";
+        list_link_init(&kp->kp_link);
+}
+
+void
+lockprof_register(kmutex_prof_t *kp, const char *name)
+{
+        if (NULL == lockprof_registry.l_next) {
+                list_init(&lockprof_registry);
+        }
+        kp->kp_name = name;
+        if (!list_link_is_linked(&kp->kp_link)) {
+                list_insert_tail(&lockprof_registry, &kp->kp_link);
+                lockprof_count++;
+        }
+}
+
+void
+lockprof_unregister(kmutex_prof_t *kp)
+{
+        if (list_link_is_linked(&kp->kp_link)) {
+                list_remove(&kp->kp_link);
+                lockprof_count--;
+        }
+}
+
+void
+lockprof_acquired(kmutex_prof_t *kp, void *ra, int contended, uint64_t wait)
+{
+        kp->kp_acquires++;
+        if (contended) {
+                kp->kp_contended++;
+                kp->kp_wait_total += wait;
+                if (wait > kp->kp_wait_max) {
+                        kp->kp_wait_max = wait;
+                        kp->kp_wait_max_ra = ra;
+                }
+        }
+        kp->kp_acquired = rdtsc();
+        kp->kp_holder_ra = ra;
+}
+
+void
+lockprof_released(kmutex_prof_t *kp)
+{
+        uint64_t held = rdtsc() - kp->kp_acquired;
+
+        kp->kp_hold_total += held;
+        if (held > kp->kp_hold_max) {
+                kp->kp_hold_max = held;
+                kp->kp_hold_max_ra = kp->kp_holder_ra;
+        }
+}
+
+/* lockstat            the 20 mutexes with the most total wait
+ * lockstat <n>        the n worst
+ * lockstat reset      zero every mutex's counters */
+int
+lockprof_kshell(kshell_t *ksh, int argc, char **argv)
+{
+        kmutex_prof_t *kp, *snap, tmp;
+        int count = LOCKPROF_DEFAULT_COUNT;
+        int n = 0, i, j;
+
+        if (0 == lockprof_count) {
+                kprintf(ksh, "lockstat: no mutexes registered (see kmutex_set_name)\n");
+                return 0;
+        }
+        if (argc > 1) {
+                if (0 == strcmp(argv[1], "reset")) {
+                        list_iterate_begin(&lockprof_registry, kp, kmutex_prof_t, kp_link) {
+                                kp->kp_acquires = kp->kp_contended = 0;
+                                kp->kp_wait_total = kp->kp_wait_max = 0;
+                                kp->kp_hold_total = kp->kp_hold_max = 0;
+                                kp->kp_wait_max_ra = kp->kp_hold_max_ra = NULL;
+                        } list_iterate_end();
+                        return 0;
+                }
+                if (!stats_parse_uint(argv[1], &count)) {
+                        kprintf(ksh, "usage: lockstat [count | reset]\n");
+                        return 0;
+                }
+        }
+        /* printing may block, so sort a snapshot rather than the registry */
+        if (NULL == (snap = kmalloc(lockprof_count * sizeof(*snap)))) {
+                kprintf(ksh, "lockstat: out of memory\n");
+                return 0;
+        }
+        list_iterate_begin(&lockprof_registry, kp, kmutex_prof_t, kp_link) {
+                if (0 == kp->kp_acquires) {
+                        continue;
+                }
+                tmp = *kp;
+                for (j = n; j > 0 && snap[j - 1].kp_wait_total < tmp.kp_wait_total; j--) {
+                        snap[j] = snap[j - 1];
+                }
+                snap[j] = tmp;
+                n++;
+        } list_iterate_end();
+
+        kprintf(ksh, "%d mutexes registered, %d ever taken; times in kcycles\n",
+                lockprof_count, n);
+        for (i = 0; i < n && i < count; i++) {
+                kp = &snap[i];
+                kprintf(ksh, "%-8s %p: %u acq, %u contended, wait %u (max %u at %p), "
+                        "hold %u (max %u at %p)\n",
+                        kp->kp_name, kp->kp_lock, kp->kp_acquires, kp->kp_contended,
+                        stats_kcycles(kp->kp_wait_total), stats_kcycles(kp->kp_wait_max),
+                        kp->kp_wait_max_ra,
+                        stats_kcycles(kp->kp_hold_total), stats_kcycles(kp->kp_hold_max),
+                        kp->kp_hold_max_ra);
+        }
+        kfree(snap);
+        return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ *  FILE: workqueue.c
+ *  DESC: deferred work run by a pool of kernel worker threads
+ */
+
+#include "globals.h"
+#include "errno.h"
+
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+#include "main/interrupt.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "proc/workqueue.h"
+
+#include "test/kshell/kshell.h"
+#include "test/kshell/io.h"
+
+/* Everything here is shared with interrupt context (work_queue() and the
+ * delay timers), so it is only touched with the IPL at IPL_HIGH. */
+static list_t workq_list[WORK_NPRIO];
+static int workq_npending = 0;
+static int workq_stopping = 0;
+
+/* idle workers sleep here */
+static ktqueue_t workq_waitq;
+
+static proc_t *workq_proc[WORKQ_NWORKERS];
+
+static uint32_t workq_nqueued = 0;
+static uint32_t workq_ncoalesced = 0;   /* already pending when queued */
+static uint32_t workq_nrun[WORK_NPRIO];
+
+static void *workq_worker_run(int arg1, void *arg2);
+
+static __attribute__((unused)) void
+workqueue_init(void)
+{
+        char name[PROC_NAME_LEN];
+        kthread_t *thr;
+        int i;
+
+        for (i = 0; i < WORK_NPRIO; i++) {
+                list_init(&workq_list[i]);
+        }
+        sched_queue_init(&workq_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        for (i = 0; i < WORKQ_NWORKERS; i++) {
+                snprintf(name, sizeof(name), "kworker%d", i);
+                workq_proc[i] = proc_create(name);
+                KASSERT(NULL != workq_proc[i]);
+                thr = kthread_create(workq_proc[i], workq_worker_run, i, NULL);
+                KASSERT(NULL != thr);
+                sched_make_runnable(thr);
+        }
+}
+init_func(workqueue_init);
+init_depends(sched_init);
+
+/* Called with the IPL at IPL_HIGH. */
+static work_t *
+workq_dequeue(void)
+{
+        work_t *w;
+        int i;
+
+        for (i = 0; i < WORK_NPRIO; i++) {
+                if (!list_empty(&workq_list[i])) {
+                        w = list_head(&workq_list[i], work_t, w_link);
+                        list_remove(&w->w_link);
+                        workq_npending--;
+                        return w;
+                }
+        }
+        return NULL;
+}
+
+static void *
+workq_worker_run(int arg1, void *arg2)
+{
+        work_t *w;
+        int prio;
+        uint8_t oldIPL;
+
+        while (1) {
+                /* nothing may be queued between finding the lists empty
+                 * and going to sleep */
+                oldIPL = intr_getipl();
+                intr_setipl(IPL_HIGH);
+                while (NULL == (w = workq_dequeue()) && !workq_stopping) {
+                        sched_sleep_on(&workq_waitq);
+                }
+                intr_setipl(oldIPL);
+
+                if (NULL == w) {
+                        dbg(DBG_PROC, "kworker%d: exiting\n", arg1);
+                        kthread_exit((void *)0);
+                }
+
+                /* w may be queued again, or freed, once its function
+                 * starts, so read what we need first */
+                prio = w->w_prio;
+                w->w_func(w->w_arg);
+                workq_nrun[prio]++;
+        }
+        return NULL;
+}
+
+static void
+work_timer_fire(void *arg)
+{
+        work_t *w = (work_t *)arg;
+        work_queue(w, w->w_prio);
+}
+
+void
+work_init(work_t *w, work_func_t func, void *arg)
+{
+        list_link_init(&w->w_link);
+        w->w_func = func;
+        w->w_arg = arg;
+        w->w_prio = WORK_PRIO_NORMAL;
+        ktimer_init(&w->w_timer, work_timer_fire, w);
+}
+
+int
+work_queue(work_t *w, int prio)
+{
+        uint8_t oldIPL;
+
+        KASSERT(0 <= prio && prio < WORK_NPRIO);
+        oldIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&w->w_link)) {
+                workq_ncoalesced++;
+                intr_setipl(oldIPL);
+                return 0;
+        }
+        /* asking for it now overrides a pending delay */
+        ktimer_del(&w->w_timer);
+
+        w->w_prio = prio;
+        list_insert_tail(&workq_list[prio], &w->w_link);
+        workq_npending++;
+        workq_nqueued++;
+        sched_wakeup_on(&workq_waitq);
+        intr_setipl(oldIPL);
+        return 1;
+}
+
+int
+work_queue_delayed(work_t *w, int prio, uint32_t ticks)
+{
+        uint8_t oldIPL;
+
+        KASSERT(0 <= prio && prio < WORK_NPRIO);
+        if (0 == ticks) {
+                return work_queue(w, prio);
+        }
+        oldIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&w->w_link) || ktimer_pending(&w->w_timer)) {
+                workq_ncoalesced++;
+                intr_setipl(oldIPL);
+                return 0;
+        }
+        w->w_prio = prio;
+        ktimer_add(&w->w_timer, ticks);
+        intr_setipl(oldIPL);
+        return 1;
+}
+
+int
+work_cancel(work_t *w)
+{
+        uint8_t oldIPL;
+        int ret;
+
+        oldIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&w->w_link)) {
+                list_remove(&w->w_link);
+                workq_npending--;
+                ret = 1;
+        } else {
+                ret = ktimer_del(&w->w_timer);
+        }
+        intr_setipl(oldIPL);
+        return ret;
+}
+
+int
+work_pending(work_t *w)
+{
+        return list_link_is_linked(&w->w_link) || ktimer_pending(&w->w_timer);
+}
+
+void
+workqueue_shutdown(void)
+{
+        int i, pid, ret;
+        uint8_t oldIPL;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+
+        oldIPL = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        workq_stopping = 1;
+        sched_broadcast_on(&workq_waitq);
+        intr_setipl(oldIPL);
+
+        for (i = 0; i < WORKQ_NWORKERS; i++) {
+                /* reaping frees the proc */
+                pid = workq_proc[i]->p_pid;
+                ret = do_waitpid(pid, 0, NULL);
+                KASSERT(ret == pid);
+                workq_proc[i] = NULL;
+        }
+}
+
+/* workstat           queued, coalesced and completed work items */
+int
+workqueue_kshell(kshell_t *ksh, int argc, char **argv)
+{
+        static const char *names[WORK_NPRIO] = { "high", "normal", "low" };
+        int i;
+
+        kprintf(ksh, "%d workers, %d pending, %u queued, %u coalesced\n",
+                WORKQ_NWORKERS, workq_npending, workq_nqueued, workq_ncoalesced);
+        for (i = 0; i < WORK_NPRIO; i++) {
+                kprintf(ksh, "  %-6s: %u run\n", names[i], workq_nrun[i]);
+        }
+        return 0;
+}
@@ -0,0 +1,191 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/init.h"
+#include "util/list.h"
+#include "util/debug.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/kmalloc.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "vm/vmmap.h"
+#include "vm/futex.h"
+
+#define FUTEX_NBUCKETS 64
+
+/*
+ * Which word a futex is. A word in a MAP_SHARED mapping is named by its
+ * object and its place in that object, so that every process mapping it
+ * finds the same futex. A word in a MAP_PRIVATE mapping is named by the
+ * address space and its virtual address: its vma_obj is only the top of
+ * a shadow chain, and fork replaces that under the parent's waiters.
+ */
+typedef struct futex_key {
+    void        *k_id;          /* the mmobj if shared, else the vmmap */
+    uint32_t    k_pagenum;      /* page in the object, or virtual page */
+    uint32_t    k_offset;
+    mmobj_t     *k_obj;         /* shared only, to hold a reference on */
+} futex_key_t;
+
+/* One per word that currently has waiters. For a shared word it holds a
+ * reference on the object so that the key stays unique while it exists;
+ * a private word's waiters all belong to the process owning the vmmap. */
+typedef struct futex {
+    futex_key_t f_key;
+    int         f_nwaiters;
+    ktqueue_t   f_waitq;
+    list_link_t f_link;
+} futex_t;
+
+static list_t futex_hash[FUTEX_NBUCKETS];
+
+static __attribute__((unused)) void
+futex_init(void)
+{
+    int i;
+    for (i = 0; i < FUTEX_NBUCKETS; i++) {
+        list_init(&futex_hash[i]);
+    }
+}
+init_func(futex_init);
+
+static list_t *
+futex_bucket(futex_key_t *key)
+{
+    uint32_t h = ((uint32_t)key->k_id >> 4) ^ (key->k_pagenum * 31) ^ (key->k_offset >> 2);
+    return &futex_hash[h % FUTEX_NBUCKETS];
+}
+
+/*
+ * Resolves uaddr in the current address space to its key. Fails with
+ * EFAULT if nothing readable is mapped there.
+ */
+static int
+futex_key(uint32_t *uaddr, futex_key_t *key)
+{
+    uint32_t vfn = ADDR_TO_PN(uaddr);
+    vmarea_t *vma;
+
+    if (0 != ((uintptr_t)uaddr & (sizeof(uint32_t) - 1))) {
+        return -EINVAL;
+    }
+    vma = vmmap_lookup(curproc->p_vmmap, vfn);
+    if (NULL == vma || !(vma->vma_prot & PROT_READ)) {
+        return -EFAULT;
+    }
+    if (vma->vma_flags & MAP_SHARED) {
+        key->k_id = vma->vma_obj;
+        key->k_pagenum = vma->vma_off + (vfn - vma->vma_start);
+        key->k_obj = vma->vma_obj;
+    } else {
+        key->k_id = curproc->p_vmmap;
+        key->k_pagenum = vfn;
+        key->k_obj = NULL;
+    }
+    key->k_offset = PAGE_OFFSET(uaddr);
+    return 0;
+}
+
+static futex_t *
+futex_find(futex_key_t *key)
+{
+    futex_t *f;
+    list_iterate_begin(futex_bucket(key), f, futex_t, f_link) {
+        if (f->f_key.k_id == key->k_id && f->f_key.k_pagenum == key->k_pagenum
+            && f->f_key.k_offset == key->k_offset) {
+            return f;
+        }
+    } list_iterate_end();
+    return NULL;
+}
+
+static int
+futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    futex_key_t key;
+    uint32_t cur;
+    futex_t *f;
+    int ret;
+
+    if ((ret = futex_key(uaddr, &key)) < 0) {
+        return ret;
+    }
+
+    if (NULL == (f = futex_find(&key))) {
+        if (NULL == (f = kmalloc(sizeof(futex_t)))) {
+            return -ENOMEM;
+        }
+        f->f_key = key;
+        f->f_nwaiters = 0;
+        sched_queue_init(&f->f_waitq);
+        list_link_init(&f->f_link);
+        list_insert_tail(futex_bucket(&key), &f->f_link);
+        if (NULL != key.k_obj) {
+            key.k_obj->mmo_ops->ref(key.k_obj);
+        }
+    }
+    f->f_nwaiters++;
+
+    /* The read may block on a page fault, but nothing else can run
+     * between the read completing and us going to sleep, so a waker
+     * that changes the word after we read it will find us queued. */
+    if ((ret = copy_from_user(&cur, uaddr, sizeof(cur))) >= 0) {
+        if (cur != val) {
+            ret = -EAGAIN;
+        } else {
+            ret = sched_cancellable_sleep_on(&f->f_waitq);
+        }
+    }
+
+    if (0 == --f->f_nwaiters) {
+        list_remove(&f->f_link);
+        if (NULL != f->f_key.k_obj) {
+            f->f_key.k_obj->mmo_ops->put(f->f_key.k_obj);
+        }
+        kfree(f);
+    }
+    return ret;
+}
+
+static int
+futex_wake(uint32_t *uaddr, uint32_t count)
+{
+    futex_key_t key;
+    futex_t *f;
+    int ret, woken = 0;
+
+    if ((ret = futex_key(uaddr, &key)) < 0) {
+        return ret;
+    }
+    if (NULL == (f = futex_find(&key))) {
+        return 0;
+    }
+    /* the woken threads free f once the last of them has left */
+    while ((uint32_t)woken < count && NULL != sched_wakeup_on(&f->f_waitq)) {
+        woken++;
+    }
+    return woken;
+}
+
+/*
+ * Entry point for the futex syscall. Returns 0 or the number of threads
+ * woken on success, -errno on failure.
+ */
+int
+do_futex(uint32_t *uaddr, int op, uint32_t val)
+{
+    switch (op) {
+        case FUTEX_WAIT:
+            return futex_wait(uaddr, val);
+        case FUTEX_WAKE:
+            return futex_wake(uaddr, val);
+        default:
+            return -EINVAL;
+    }
+}
@@ -0,0 +1,106 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "main/tsc.h"
+
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/mman.h"
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+
+#include "vm/anon.h"
+#include "vm/vmmap.h"
+#include "vm/kinfo.h"
+
+#include "proc/proc.h"
+
+/* The shared time page. We keep the reference anon_create gives us for
+ * the life of the kernel, and anon pages stay pinned while resident, so
+ * kinfo_time always points at the same physical page. */
+static mmobj_t *kinfo_time_obj = NULL;
+static kinfo_time_t *kinfo_time = NULL;
+
+/*
+ * Called at boot time, after anon_init, to create the shared time page.
+ */
+void
+kinfo_init(void)
+{
+    pframe_t *pf;
+
+    kinfo_time_obj = anon_create();
+    KASSERT(NULL != kinfo_time_obj && "Ran out of memory while booting.");
+
+    if (pframe_get(kinfo_time_obj, 0, &pf) < 0) {
+        panic("kinfo: could not get the time page\n");
+    }
+    kinfo_time = (kinfo_time_t *)pf->pf_addr;
+    kinfo_time->ki_tsc_base = rdtsc();
+}
+
+/*
+ * Maps the kinfo pages at KINFO_ADDR in p's address space, replacing
+ * whatever is there. Called whenever a process gets a new address
+ * space: on creation, in the child of a fork (which would otherwise
+ * share its parent's page) and after exec.
+ */
+int
+kinfo_map(proc_t *p)
+{
+    vmarea_t *vma;
+    pframe_t *pf;
+    kinfo_proc_t *kp;
+    int err;
+
+    /* per-process page: a fresh shared anon object */
+    err = vmmap_map(p->p_vmmap, NULL, ADDR_TO_PN(KINFO_ADDR), 1, PROT_READ,
+                    MAP_SHARED, 0, VMMAP_DIR_HILO, &vma);
+    if (err < 0) {
+        return -ENOMEM;
+    }
+    if ((err = pframe_get(vma->vma_obj, 0, &pf)) < 0) {
+        return err;
+    }
+    kp = (kinfo_proc_t *)pf->pf_addr;
+    kp->ki_pid = p->p_pid;
+
+    /* time page: map a throwaway anon object and swap in the shared one */
+    err = vmmap_map(p->p_vmmap, NULL, ADDR_TO_PN(KINFO_ADDR) + 1, 1, PROT_READ,
+                    MAP_SHARED, 0, VMMAP_DIR_HILO, &vma);
+    if (err < 0) {
+        return -ENOMEM;
+    }
+    vma->vma_obj->mmo_ops->put(vma->vma_obj);
+    kinfo_time_obj->mmo_ops->ref(kinfo_time_obj);
+    vma->vma_obj = kinfo_time_obj;
+
+    return 0;
+}
+
+/* keeps the compiler from moving the data stores outside the ki_seq bumps */
+#define kinfo_barrier() __asm__ __volatile__("" ::: "memory")
+
+void
+kinfo_tick(void)
+{
+    kinfo_time->ki_seq++;
+    kinfo_barrier();
+    kinfo_time->ki_ticks++;
+    kinfo_barrier();
+    kinfo_time->ki_seq++;
+}
+
+void
+kinfo_calibrate(uint32_t hz, uint32_t tsc_khz)
+{
+    kinfo_time->ki_seq++;
+    kinfo_barrier();
+    kinfo_time->ki_hz = hz;
+    kinfo_time->ki_tsc_khz = tsc_khz;
+    kinfo_barrier();
+    kinfo_time->ki_seq++;
+}
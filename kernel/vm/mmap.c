@@ -55,7 +55,7 @@ do_mmap(void *addr, size_t len, int prot, int flags,
         return (int)MAP_FAILED;
     }
     
-    if (((fd >= NFILES) || ( fd < 0)) && ((flags & MAP_ANON) != MAP_ANON)) {
+    if (((fd >= curproc->p_nfiles) || ( fd < 0)) && ((flags & MAP_ANON) != MAP_ANON)) {
         dbg(DBG_PRINT,"ERROR!!! fd = %d is out of range\n", fd);
         return (int)MAP_FAILED;
     }
@@ -124,24 +124,15 @@ shadow_put(mmobj_t *o)
     dbg(DBG_PRINT, "(GRADING3A 6.c) mmo_refcount > 0 and shadow ops are set correctly \n");
     
     (o->mmo_refcount)--;
-    int refcount = o->mmo_refcount;
-    int nrespages = o->mmo_nrespages;
     if(o->mmo_refcount == o->mmo_nrespages) {
-        /* unpin and uncache all of the object's pages */
-        while (!list_empty(&o->mmo_respages)) {
-            pframe_t *onePF = list_tail(&o->mmo_respages, pframe_t, pf_olink);
-            while (pframe_is_pinned(onePF)) {
-                pframe_unpin(onePF);
-            }
-            pframe_free(onePF);
-            
-            /* updated */
-            if (refcount != 0) {
-                return;
-            }
-        }
-        /* then free the object itself */
-        if (refcount == 0 && nrespages == 0) {
+        /* unpin and uncache all of the object's pages; nothing maps
+         * them, so they can go without TLB flushes or page table walks */
+        pframe_free_obj(o);
+        
+        /* then free the object itself, unless pageout is busy with a
+         * page, in which case freeing that page puts us again */
+        if (o->mmo_nrespages == 0) {
+            KASSERT(0 == o->mmo_refcount);
             if (o->mmo_shadowed != NULL) {
                 o->mmo_shadowed->mmo_ops->put(o->mmo_shadowed);
             }
@@ -7,6 +7,7 @@
 #include "vm/anon.h"
 
 #include "proc/proc.h"
+#include "proc/workqueue.h"
 
 #include "util/debug.h"
 #include "util/list.h"
@@ -23,10 +24,22 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
 
+/*
+ * Areas of exiting processes' address spaces, waiting for vmmap_reap_work
+ * to drop their objects' references; see vmmap_destroy_deferred().
+ * Linked through vma_plink.
+ */
+static list_t vmmap_reap_list;
+static work_t vmmap_reap_work;
+
+static void vmmap_reap_run(void *arg);
+
 void
 vmmap_init(void)
 {
@@ -34,6 +47,8 @@ vmmap_init(void)
         KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
         vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t));
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
+        list_init(&vmmap_reap_list);
+        work_init(&vmmap_reap_work, vmmap_reap_run, NULL);
 }
 
 vmarea_t *
@@ -78,6 +93,14 @@ vmmap_destroy(vmmap_t *map)
     KASSERT(NULL != map);
     dbg(DBG_PRINT, "(GRADING3A 3.a) The map passed to this function exists\n");
         /*NOT_YET_IMPLEMENTED("VM: vmmap_destroy");*/
+        /* the last put of an object frees its pages, so nothing may
+         * still map them */
+        if (NULL != map->vmm_proc) {
+            pt_unmap_range(map->vmm_proc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+            if (map->vmm_proc == curproc) {
+                tlb_flush_all();
+            }
+        }
         if(!(list_empty(&map->vmm_list))){
             vmarea_t *vma;
             list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink){
@@ -106,6 +129,72 @@ vmmap_destroy(vmmap_t *map)
         slab_obj_free(vmmap_allocator, map);
 }
 
+/*
+ * Like vmmap_destroy(), for the address space of an exiting process.
+ * Dropping the last reference to an object frees each of its pages one
+ * at a time, and freeing a page unmaps it from every process that could
+ * map it. Instead, the whole user range is unmapped from the process
+ * here in one go and the areas are taken out of their objects' lists, so
+ * that no per-page unmapping can find them. Then the object references
+ * are handed to a low priority work item to drop, so exit does not take
+ * time in proportion to how much memory the process had.
+ */
+void
+vmmap_destroy_deferred(vmmap_t *map)
+{
+        vmarea_t *vma;
+
+        KASSERT(NULL != map);
+        if (NULL != map->vmm_proc) {
+                pt_unmap_range(map->vmm_proc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+                if (map->vmm_proc == curproc) {
+                        tlb_flush_all();
+                }
+        }
+
+        list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+                list_remove(&vma->vma_plink);
+                if ((vma->vma_flags & MAP_PRIVATE) == MAP_PRIVATE) {
+                        list_remove(&vma->vma_olink);
+                }
+                vma->vma_vmmap = NULL;
+                list_insert_tail(&vmmap_reap_list, &vma->vma_plink);
+        } list_iterate_end();
+        slab_obj_free(vmmap_allocator, map);
+
+        if (!list_empty(&vmmap_reap_list)) {
+                work_queue(&vmmap_reap_work, WORK_PRIO_LOW);
+        }
+}
+
+/* Drops the object references of every area on vmmap_reap_list. Areas
+ * queued while a put() blocks are picked up by the same run. */
+static void
+vmmap_reap_run(void *arg)
+{
+        vmarea_t *vma;
+
+        while (!list_empty(&vmmap_reap_list)) {
+                vma = list_head(&vmmap_reap_list, vmarea_t, vma_plink);
+                list_remove(&vma->vma_plink);
+                if (vma->vma_obj != NULL) {
+                        vma->vma_obj->mmo_ops->put(vma->vma_obj);
+                }
+                vmarea_free(vma);
+        }
+}
+
+/*
+ * Finishes any deferred teardown now. Called at shutdown, since the
+ * areas may hold vnodes and pinned pages.
+ */
+void
+vmmap_reap_flush(void)
+{
+        work_cancel(&vmmap_reap_work);
+        vmmap_reap_run(NULL);
+}
+
 /* Add a vmarea to an address space. Assumes (i.e. asserts to some extent)
  * the vmarea is valid.  This involves finding where to put it in the list
  * of VM areas, and adding it. Don't forget to set the vma_vmmap for the
@@ -592,6 +681,7 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 }
                 vmmap_insert(map, new_vma);
                 pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(startvfn), (uintptr_t)PN_TO_ADDR(endvfn));
+                tlb_flush_range((uintptr_t)PN_TO_ADDR(startvfn), endvfn - startvfn);
             }
             /* Case 2:      [      *****]***  */
             else if( (startvfn > vma->vma_start)&&(startvfn < vma->vma_end)&&
@@ -600,6 +690,7 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 uint32_t temp_vfn = vma->vma_end;
                 vma->vma_end = startvfn;
                 pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(startvfn), (uintptr_t)PN_TO_ADDR(temp_vfn));
+                tlb_flush_range((uintptr_t)PN_TO_ADDR(startvfn), temp_vfn - startvfn);
             }
             /* Case 3: *****[*****      ]     */
             else if( (startvfn <= vma->vma_start)&&
@@ -609,23 +700,28 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
                 uint32_t temp_vfn = vma->vma_start;
                 vma->vma_start = endvfn;
                 pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(temp_vfn), (uintptr_t)PN_TO_ADDR(endvfn));
+                tlb_flush_range((uintptr_t)PN_TO_ADDR(temp_vfn), endvfn - temp_vfn);
             }
             /* Case 4:   ***[***********]***  */
             else if( (startvfn <= vma->vma_start)&&(endvfn >= vma->vma_end) ){
                 uint32_t temp_start_vfn = vma->vma_start;
                 uint32_t temp_end_vfn = vma->vma_end;
                 if(!list_empty(&map->vmm_list)){
-                    if (vma->vma_obj != NULL) {
-                        vma->vma_obj->mmo_ops->put(vma->vma_obj);
-                    }
+                    /* Unmap and flush first: dropping the last reference
+                     * frees the object's pages, and no stale mapping may
+                     * outlive them. */
+                    pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(temp_start_vfn), (uintptr_t)PN_TO_ADDR(temp_end_vfn));
+                    tlb_flush_range((uintptr_t)PN_TO_ADDR(temp_start_vfn), temp_end_vfn - temp_start_vfn);
 
                     list_remove(&vma->vma_plink);
                     /* Corrected: */
                     if ((vma->vma_flags & MAP_PRIVATE) == MAP_PRIVATE){
                         list_remove(&vma->vma_olink);
                     }
+                    if (vma->vma_obj != NULL) {
+                        vma->vma_obj->mmo_ops->put(vma->vma_obj);
+                    }
                     vmarea_free(vma);
-                    pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(temp_start_vfn), (uintptr_t)PN_TO_ADDR(temp_end_vfn));
                 }
             } 
         } list_iterate_end();